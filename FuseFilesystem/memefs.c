@@ -20,21 +20,48 @@
 
 
 #define FUSE_USE_VERSION 35
-#define BLOCK_SIZE 512
+#define _GNU_SOURCE // O_DIRECT
 
 #include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h> // fuse_parse_cmdline
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // linux/fs.h has its own, memefs.h defines ours
 #include <utime.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include "memefs.h"
+#include "trace.h"
+
+/*
+ * USDT probes (provider memefs), e.g. bpftrace -l 'usdt:./memefs:*'.
+ * Each one is a single nop until a tracer attaches, without sys/sdt.h
+ * (systemtap-sdt-dev) they compile to nothing.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(memefs, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...) do { } while(0)
+#endif
 
 /*
  * Command line options
@@ -43,53 +70,338 @@
  * fuse_opt_parse would attempt to free() them when the user specifies
  * different values on the command line.
  */
-typedef struct memefs_superblock {
-	char signature[16];        // Filesystem signature
-	uint8_t cleanly_unmounted; // Flag for unmounted state
-	uint8_t reserved_bytes[3];     // Reserved bytes
-	uint32_t fs_version;       // Filesystem version
-	uint8_t fs_ctime[8];       // Creation timestamp in BCD format
-	uint16_t main_fat;         // Starting block for main FAT
-	uint16_t main_fat_size;    // Size of the main FAT
-	uint16_t backup_fat;       // Starting block for backup FAT
-	uint16_t backup_fat_size;  // Size of the backup FAT
-	uint16_t directory_start;  // Starting block for directory
-	uint16_t directory_size;   // Directory size in blocks
-	uint16_t num_user_blocks;  // Number of user data blocks
-	uint16_t first_user_block; // First user data block
-	char volume_label[16];     // Volume label
-	uint8_t unused[448];       // Unused space for alignment
-} __attribute__((packed)) memefs_superblock_t;
-
-typedef struct directory_block {
-	uint16_t type;
-	uint16_t start_block;
-	char filename[11];
-	uint8_t unused;
-	uint8_t timestamp[8];
-	uint32_t size;
-	uint16_t ownerUID;
-	uint16_t groupGID;
-} __attribute__((packed)) memefs_directory_t;
-
-static int mount_memefs();
-static int unmount_memefs();
-static int convert_filename(char* full, const char *path);
-static void reverse_conversion(char* full, char* original);
+static struct options {
+	int lazy_load;
+	int prefetch;
+	int cache_blocks;
+	int mmap;
+	int odirect;
+	int read_only;
+	int checksums;
+	int replay_timed;
+	int replay_crash;
+	char *image;
+	char *record;
+	char *replay;
+} options;
+
+#define KEY_VOLUME 0
+#define KEY_READ_ONLY 1
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("lazy_load", lazy_load),
+	OPTION("prefetch", prefetch),
+	OPTION("cache_blocks=%d", cache_blocks),
+	OPTION("mmap", mmap),
+	OPTION("odirect", odirect),
+	OPTION("checksums", checksums),
+	OPTION("record=%s", record),
+	OPTION("replay=%s", replay),
+	OPTION("replay_timed", replay_timed),
+	OPTION("replay_crash", replay_crash),
+	FUSE_OPT_KEY("volume=", KEY_VOLUME),
+	FUSE_OPT_KEY("ro", KEY_READ_ONLY),
+	FUSE_OPT_END
+};
+
+// A place in a file's chain: block holds the file's logical block `logical`.
+// Blocks only move when a file shrinks, so a cursor stays valid until then.
+typedef struct chain_cursor {
+	int block;                 // -1 to start from start_block
+	uint32_t logical;
+} chain_cursor_t;
+
+// Sequential writes through an open file are gathered in its buffer and
+// written to the user blocks in block-aligned batches. The cursor is kept
+// between requests, so a streaming reader or writer never walks the chain.
+#define WRITE_BUFFER_SIZE (64 * BLOCK_SIZE)
+typedef struct open_file {
+	int index;                 // directory slot, -1 once unlinked
+	chain_cursor_t cursor;
+	uint32_t buffer_offset;    // file offset of buffer[0]
+	size_t buffered;
+	int reserved;              // free blocks held back for the buffer
+	pthread_mutex_t lock;      // the fields above, taken after the volume lock
+	struct open_file *next;
+	uint8_t buffer[WRITE_BUFFER_SIZE];
+} open_file_t;
+
+/*
+ * Backing I/O for user blocks. Runs of blocks are submitted in batches to
+ * io_uring, or to a small thread pool where io_uring is not available.
+ * Both are shared by every volume.
+ */
+#define IO_SYNC 0
+#define IO_URING 1
+#define IO_POOL 2
+#define IO_DEPTH 64
+#define IO_MAX_RUN 32
+#define IO_THREADS 4
+#define WRITEBACK_THRESHOLD 32
+
+typedef struct io_batch {
+	int pending;
+	int error;
+} io_batch_t;
+
+typedef struct io_request {
+	int in_use;
+	int write;
+	struct volume *volume;
+	int first_block;
+	int blocks;
+	struct iovec iov[IO_MAX_RUN];
+	io_batch_t *batch;
+	struct io_request *next;   // thread pool queue
+} io_request_t;
+
+typedef struct io_ring {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_size;
+	size_t cq_map_size;
+	size_t sqes_size;
+	unsigned queued;           // sqes not yet passed to io_uring_enter
+	int reaping;               // a thread waits in io_uring_enter without io_lock
+} io_ring_t;
+
+// Request buffer of the worker pool, kept per volume for reuse
+typedef struct pool_buffer {
+	struct fuse_buf buf;
+	struct pool_buffer *next;
+} pool_buffer_t;
+
+/*
+ * Everything that belongs to one mounted image. Each volume is served by its
+ * own fuse instance whose private_data points here. The block cache, the
+ * backing I/O, the prefetch thread and the worker pool are shared by all of them.
+ */
+#define DIR_WORDS ((16 * 14 + 63) / 64)
+typedef struct volume {
+	char *image;               // image path as given
+	char *mountpoint;          // NULL when fuse_main mounts it
+	int number;                // position among the volumes, kept in traces
+	char* abs_path;
+	int image_fd;
+	struct fuse *fuse;         // only with volume= options
+	int serving;
+	int requests;              // being read or run by the worker pool
+	pool_buffer_t *spare_buffers;
+
+	memefs_superblock_t main_superblock;
+	memefs_superblock_t backup_superblock;
+	uint16_t main_FAT[256];
+	uint16_t backup_FAT[256];
+	memefs_directory_t directory_blocks[16 * 14];
+
+	// Hot part of the directory: the 8.3 name of each slot padded to 16 bytes and
+	// a bitmap of the slots in use. directory_blocks keeps the cold fields.
+	uint8_t dir_keys[16 * 14][16] __attribute__((aligned(16)));
+	uint64_t dir_used[DIR_WORDS];
+
+	// Decoded "name.ext" of each slot in use, for readdir
+	char dir_names[16 * 14][13];
+
+	// Free user blocks and directory slots, kept by set_fat and index_dirent so
+	// statfs and the allocators never scan for them
+	int free_blocks;
+	int free_slots;
+	// Free blocks held back for buffered writes, allocate_block leaves them alone
+	int reserved_blocks;
+
+	// Held by callbacks that change the open file list, slot_writer or the metadata
+	pthread_mutex_t lock;
+	open_file_t *open_files;
+	// The one open file per slot holding buffered appends, so they stay in order
+	open_file_t *slot_writer[16 * 14];
+
+	// Metadata exactly as it was last committed, in on-disk (big-endian) form
+	// They point into image_map when the image is mapped
+	uint8_t private_FAT[BLOCK_SIZE];
+	uint8_t private_directory[14 * BLOCK_SIZE];
+	uint8_t *disk_FAT;
+	uint8_t *disk_directory;
+
+	// With -o mmap the whole image is mapped MAP_SHARED and used in place
+	uint8_t *image_map;
+
+	// Changes made since the last commit
+	uint8_t fat_dirty[256];
+	uint8_t dirent_dirty[16 * 14];
+	uint8_t block_dirty[256];  // under cache_lock, the cache and completions of any volume read it
+
+	int block_slot[256];       // cache slot holding each block, -1 when it is not cached
+	int cache_unsynced;        // dirty blocks were written back since the last commit
+	int evicting;              // dirty blocks claim_slot is writing back without cache_lock
+	int data_fd;               // image_fd, or a second O_DIRECT descriptor for user blocks
+	io_batch_t writeback_batch;
+
+	uint32_t log_generation;
+	uint32_t log_tail;
+	size_t log_capacity;       // smaller when the checksum table takes the end of the log
+
+	// CRC32C of every block as it was last written, while the image has checksums
+	int checksums;
+	uint32_t block_crc[256];
+	uint8_t block_verified[256]; // mapped blocks are checked once per mount
+} volume_t;
+
+// Every image served by this process
+volume_t **volumes;
+int num_volumes;
+int volumes_serving;
+pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+struct fuse_cmdline_opts serve_options;
+
+// Worker pool of the volume= volumes: every thread waits on one epoll set
+// holding their fuse devices and the wakeup eventfd. Its size is -o max_threads,
+// POOL_THREADS when unset, and at most POOL_MAX_THREADS
+#define POOL_THREADS 10
+#define POOL_MAX_THREADS 64
+int pool_epoll = -1;
+int pool_wakeup = -1;
+pthread_t *pool_threads;
+int pool_size;
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+
+// Volume of the callbacks an in-process replay calls, which have no fuse context
+__thread volume_t *replay_volume;
+
+// With -o record the trace every callback is appended to
+FILE *recorder;
+struct timespec recorder_origin;
+
+// Block cache: a slab of cache_slots buffers shared by every volume, user
+// blocks are read into it on first use. The slots are the memory budget.
+uint8_t *cache_data;
+int cache_slots;
+int cache_used;
+int cache_hand;
+volume_t **cache_owner;     // volume of the block held by each slot
+int *cache_block;           // block held by each slot, -1 when the slot is free
+uint8_t *cache_ref;         // CLOCK reference bits
+uint8_t *cache_busy;        // a write from the slot is in flight, it must not be reused
+int *cache_pins;            // copies from or into the slot in progress, it must not be reused
+unsigned long cache_hits;
+unsigned long cache_misses;
+unsigned long cache_evictions;
+unsigned long cache_writebacks;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_evicted = PTHREAD_COND_INITIALIZER;
+
+int io_backend = IO_SYNC;
+io_ring_t io_ring = { .fd = -1 };
+io_request_t io_requests[IO_DEPTH];
+io_request_t *io_queue_head;
+io_request_t *io_queue_tail;
+int io_in_flight;                  // submitted requests not completed yet, every volume
+unsigned long io_completed;
+pthread_t io_threads[IO_THREADS];
+int io_threads_running;
+// cache_lock may be held while taking io_lock but never while waiting for I/O:
+// completions take cache_lock to clear cache_busy
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+
+// Recently opened files whose chains the prefetch thread reads ahead
+#define PREFETCH_QUEUE 16
+struct prefetch_request {
+	volume_t *volume;
+	int index;
+} prefetch_queue[PREFETCH_QUEUE];
+unsigned prefetch_head;
+unsigned prefetch_tail;
+int prefetch_running;
+pthread_t prefetch_thread;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_wake = PTHREAD_COND_INITIALIZER;
+volume_t *prefetch_current;       // volume whose chain is being read ahead
+pthread_cond_t prefetch_idle = PTHREAD_COND_INITIALIZER;
+
+static int mount_memefs(volume_t *vol);
+static int unmount_memefs(volume_t *vol);
+static int commit_memefs(volume_t *vol, int checkpoint);
+static int replay_log(volume_t *vol, int file_des);
+static int load_log_header(volume_t *vol, int file_des);
+static int reset_log(volume_t *vol);
+static int checkpoint_log(volume_t *vol);
+static void apply_log_records(volume_t *vol, const uint8_t *log, size_t length);
+static int recover_memefs(volume_t *vol);
+static void set_fat(volume_t *vol, int block, uint16_t value);
+static int allocate_block(volume_t *vol);
+static int io_setup();
+static void io_teardown();
+static void open_data_fd(volume_t *vol);
+static void close_data_fd(volume_t *vol);
+static void io_start_threads();
+static void start_writeback(volume_t *vol);
+static int init_cache();
+static void free_cache();
+static void release_slots(volume_t *vol);
+static uint8_t *get_block(volume_t *vol, int block);
+static uint8_t *fetch_block(volume_t *vol, int block, int may_evict);
+static uint8_t *new_block(volume_t *vol, int block);
+static void put_block(volume_t *vol, uint8_t *data);
+static int load_user_blocks(volume_t *vol);
+static int map_image(volume_t *vol);
+static void unmap_image(volume_t *vol);
+static int sync_map(volume_t *vol, int first_block, int blocks);
+static int verify_metadata(volume_t *vol, int file_des, const uint8_t *superblock, uint8_t *fat_backup);
+static int rebuild_checksums(volume_t *vol);
+static int write_checksums(volume_t *vol);
+static int block_intact(volume_t *vol, int block, const uint8_t *data);
+static void checksum_block(volume_t *vol, int block, const uint8_t *data);
+static void queue_prefetch(volume_t *vol, int index);
+static void forget_prefetch(volume_t *vol);
+static void stop_prefetch();
+static void mark_dirent_dirty(volume_t *vol, int index);
+static void index_dirent(volume_t *vol, int index);
+static int find_entry(volume_t *vol, const char *path);
+static void fill_stat(volume_t *vol, int index, struct stat *stbuf);
+static int find_free_slot(volume_t *vol);
+static void mark_block_dirty(volume_t *vol, int block);
+static int open_handle(volume_t *vol, int index, struct fuse_file_info *fi);
+static int flush_writes(volume_t *vol, int index);
+static int buffer_write(volume_t *vol, open_file_t *file, const char *buf, size_t size, off_t offset);
+static int resize_file(volume_t *vol, const char *path, off_t size);
+static off_t seek_data(volume_t *vol, const char *path, off_t offset, int whence);
+static int read_file(volume_t *vol, const char *path, open_file_t *file, char *buf, size_t size, off_t offset);
+static int seek_chain(volume_t *vol, int index, chain_cursor_t *cursor, uint32_t target, int allocate);
+static int write_file(volume_t *vol, int index, chain_cursor_t *cursor, off_t offset, const char *buf, size_t size);
 static uint8_t to_bcd(uint8_t num);
 static void generate_memefs_timestamp(uint8_t bcd_time[8]);
 void print_bcd_timestamp(const uint8_t bcd_time[8]);
 
-memefs_superblock_t main_superblock;
-memefs_superblock_t backup_superblock;
-uint16_t main_FAT[256];
-uint16_t backup_FAT[256];
-memefs_directory_t directory_blocks[16 * 14];
-uint8_t reserved_blocks[18 * BLOCK_SIZE];
-uint8_t user_blocks[220 * BLOCK_SIZE];
-char* abs_path;
+static volume_t *current_volume(){
+	return replay_volume != NULL ? replay_volume : fuse_get_context()->private_data;
+}
+
+// A read-only volume never changes, its callbacks take no volume lock
+static void lock_volume(volume_t *vol){
+	if(!options.read_only){
+		pthread_mutex_lock(&vol->lock);
+	}
+}
+
+static void unlock_volume(volume_t *vol){
+	if(!options.read_only){
+		pthread_mutex_unlock(&vol->lock);
+	}
+}
 
 static int memefs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
 	(void) fi;
 	memset(stbuf, 0, sizeof(*stbuf));
 	if(strcmp(path, "/") == 0){
@@ -98,710 +410,2496 @@ static int memefs_getattr(const char *path, struct stat *stbuf, struct fuse_file
 		return 0;
 	}
 
-	char original[14];
-
-	for(int i = 0; i < 224; i++){
-		memset(original, '\0', 14);
-        	reverse_conversion(directory_blocks[i].filename, original);
-		if(strcmp(original, path + 1) == 0){
-			stbuf->st_mode = directory_blocks[i].type;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = directory_blocks[i].size;
-			stbuf->st_uid = directory_blocks[i].ownerUID;
-			stbuf->st_gid = directory_blocks[i].groupGID;
-			return 0;
-		}
+	lock_volume(vol);
+	int i = find_entry(vol, path);
+	if(i >= 0){
+		flush_writes(vol, i);
+		fill_stat(vol, i, stbuf);
 	}
-	printf("Cannot locate file\n");
-	return -ENOENT;
+	unlock_volume(vol);
+	return i >= 0 ? 0 : -ENOENT;
 }
 
+/**
+ * Entries are returned in slot order with stable offsets: "." is at 0, ".." at
+ * 1 and slot i at i + 3, and each one carries the offset of the next, so a
+ * listing resumes after the last entry the kernel took. Names come from
+ * dir_names, attributes are added for READDIR_PLUS after flushing buffered
+ * writes, as getattr does.
+ */
 static int memefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags){
-	(void) offset;
+	volume_t *vol = current_volume();
 	(void) fi;
-	(void) flags;
-	memset(buf, 0, sizeof(*buf));
 	if(strcmp(path, "/") != 0){
 		return -ENOENT;
 	}
 
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
+	int plus = (flags & FUSE_READDIR_PLUS) != 0;
+	struct stat st;
 
-	char original[14];
-	for(int i = 0; i < 224; i++){
-		if(directory_blocks[i].type != 0 && directory_blocks[i].filename[0] != '\0' && strcmp(directory_blocks[i].filename, " ") != 0){
-			memset(original, '\0', 14);
-			reverse_conversion(directory_blocks[i].filename, original);
+	if(offset < 1 && filler(buf, ".", NULL, 1, 0)){
+		return 0;
+	}
+	if(offset < 2 && filler(buf, "..", NULL, 2, 0)){
+		return 0;
+	}
 
-			filler(buf, original, NULL, 0, 0);
+	int first = offset > 3 ? offset - 3 : 0;
+	lock_volume(vol);
+	for(int word = first / 64; word < DIR_WORDS; word++){
+		uint64_t bits = vol->dir_used[word];
+		if(word == first / 64){
+			bits &= ~0ULL << (first % 64);
+		}
+		for(; bits != 0; bits &= bits - 1){
+			int i = (word * 64) + __builtin_ctzll(bits);
+			if(plus){
+				flush_writes(vol, i);
+				fill_stat(vol, i, &st);
+			}
+			if(filler(buf, vol->dir_names[i], plus ? &st : NULL, i + 4, plus ? FUSE_FILL_DIR_PLUS : 0)){
+				unlock_volume(vol);
+				return 0;
+			}
 		}
 	}
+	unlock_volume(vol);
 
 	return 0;
 }
 
+static int create_file(volume_t *vol, const char *path, mode_t mode, struct fuse_file_info *fi){
+	char filename[11];
+
+	//Files live in the root directory under 8.3 names
+	if(path[0] != '/' || make_filename(filename, path + 1) != 0){
+		const char *dot = strchr(path + 1, '.');
+		size_t base = dot ? (size_t) (dot - (path + 1)) : strlen(path + 1);
+		return base > 8 || (dot && strlen(dot + 1) > 3) ? -ENAMETOOLONG : -EINVAL;
+	}
+	if(find_entry(vol, path) >= 0){
+		return -EEXIST;
+	}
+	int index = find_free_slot(vol);
+	if(index < 0){
+		return -ENOSPC;
+	}
+	int startBlock = allocate_block(vol);
+	if(startBlock < 0){
+		return -ENOSPC;
+	}
+	//A freed block keeps its old bytes, they must not show through a hole
+	uint8_t *data = new_block(vol, startBlock);
+	if(data == NULL){
+		set_fat(vol, startBlock, 0);
+		return -EIO;
+	}
+	put_block(vol, data);
+	uint8_t timestamp[8];
+	generate_memefs_timestamp(timestamp);
+
+	vol->directory_blocks[index].type = S_IFREG | (mode & 0777);
+	vol->directory_blocks[index].start_block = startBlock;
+	memcpy(vol->directory_blocks[index].filename, filename, 11);
+	vol->directory_blocks[index].unused = 0;
+	vol->directory_blocks[index].size = 0;
+	vol->directory_blocks[index].ownerUID = getuid();
+	vol->directory_blocks[index].groupGID = getgid();
+
+	for(int i = 0; i < 8; i++){
+		vol->directory_blocks[index].timestamp[i] = timestamp[i];
+	}
+
+	mark_dirent_dirty(vol, index);
+	return open_handle(vol, index, fi);
+}
+
 static int memefs_create(const char *path, mode_t mode, struct fuse_file_info *fi){
-	int index = 224;
+	volume_t *vol = current_volume();
+	if(options.read_only){
+		return -EROFS;
+	}
+	lock_volume(vol);
+	int result = create_file(vol, path, mode, fi);
+	unlock_volume(vol);
+	return result;
+}
 
-	for(int i = 223; i >= 0; i--){
-		if(directory_blocks[i].type == 0){
-			index = i;
-			i = -1;
+static int remove_file(volume_t *vol, const char *path){
+	int index = find_entry(vol, path);
+
+	if(index < 0){
+		return -ENOENT;
+	}
+	//Buffered appends to the file are dropped with it
+	vol->slot_writer[index] = NULL;
+	for(open_file_t *file = vol->open_files; file != NULL; file = file->next){
+		if(file->index == index){
+			pthread_mutex_lock(&file->lock);
+			file->index = -1;
+			file->buffered = 0;
+			vol->reserved_blocks -= file->reserved;
+			file->reserved = 0;
+			pthread_mutex_unlock(&file->lock);
 		}
 	}
+	vol->directory_blocks[index].type = 0;
+	strcpy(vol->directory_blocks[index].filename, " ");
+	mark_dirent_dirty(vol, index);
+	int nextFAT = vol->directory_blocks[index].start_block;
+	int current;
+	while(nextFAT >= FIRST_USER_BLOCK && nextFAT < FIRST_USER_BLOCK + NUM_USER_BLOCKS){
+		current = nextFAT;
+		nextFAT = fat_next(vol->main_FAT[current]);
+		set_fat(vol, current, 0);
+	}
+	return 0;
+}
+
+static int memefs_unlink(const char *path){
+	volume_t *vol = current_volume();
+	if(options.read_only){
+		return -EROFS;
+	}
+	lock_volume(vol);
+	int result = remove_file(vol, path);
+	unlock_volume(vol);
+	return result;
+}
 
-	if(index == 224){
-		printf("There is no space\n");
-		return -ENOSPC; // ignore
+static int memefs_open(const char *path, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	if(options.read_only && (fi->flags & O_ACCMODE) != O_RDONLY){
+		return -EROFS;
 	}
+	lock_volume(vol);
+	int i = find_entry(vol, path);
+	int result = i >= 0 ? open_handle(vol, i, fi) : -ENOENT;
+	unlock_volume(vol);
+	if(result == 0){
+		queue_prefetch(vol, i);
+	}
+	return result;
+}
 
-        if(strlen(path) > 13){ //size + 1 for . and + 1 for /
-        	printf("File Name or Extension is too long\n");
-		return 0; //ignore
-        }
+static int memefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	open_file_t *file = fi != NULL ? (open_file_t *) (uintptr_t) fi->fh : NULL;
 
-	char full[13];
-        memset(full, '\0', 13);
+	lock_volume(vol);
+	int result = read_file(vol, path, file, buf, size, offset);
+	unlock_volume(vol);
+	return result;
+}
 
-	int result = convert_filename(full, path);
+/**
+ * Copies size bytes at offset of a file, holes read as zeros. An open file's
+ * cursor saves walking the chain up to offset: the read works on a copy taken
+ * under the file's lock, which concurrent reads of one handle share.
+ */
+static int read_file(volume_t *vol, const char *path, open_file_t *file, char *buf, size_t size, off_t offset){
+	int index = find_entry(vol, path);
+	if(index == -1){
+		return -ENOENT;
+	}
+	int error = flush_writes(vol, index);
+	if(error != 0){
+		return error;
+	}
 
-	if(result != 0){
-        	printf("Couldn't convert file name\n");
+	uint32_t file_size = vol->directory_blocks[index].size;
+	if(offset < 0 || (uint64_t) offset >= file_size){
 		return 0;
 	}
+	if(size > (size_t) (file_size - offset)){
+		size = file_size - offset;
+	}
 
-	for(int i = 1; i < 12; i++){
-		if(!((full[i] >= 65 && full[i] <= 90) || (full[i] >= 97 && full[i] <= 122)  ||
-	  		(full[i] >= 48 && full[i] <= 57) || (full[i] == 94) || (full[i] == 95) ||
-	     		(full[i] == 45) || (full[i] == 61) || (full[i] == 124) || (full[i] == '\0' || full[i] == 1 || full[i] == 6))){
-			printf("This Character is invalid:%c or %d was found at index: %d\n", full[i], full[i], i);
-			return 0; //ignore
+	//The handle of an unlinked file has no cursor into whatever now has its name
+	chain_cursor_t cursor = { -1, 0 };
+	if(file != NULL){
+		pthread_mutex_lock(&file->lock);
+		if(file->index == index){
+			cursor = file->cursor;
 		}
+		pthread_mutex_unlock(&file->lock);
 	}
-
-        char original[14];
-	for(int i = 0; i < 224; i++){
-		memset(original, '\0', 14);
-        	reverse_conversion(directory_blocks[i].filename, original);
-		if(strcmp(original, path + 1) == 0){
-			printf("This file already exists\n");
-			return -EEXIST; //duplicate
+	size_t read_bytes = 0;
+	while(read_bytes < size){
+		uint32_t position = offset + read_bytes;
+		size_t count = position % BLOCK_SIZE;
+		size_t length = BLOCK_SIZE - count;
+		if(length > size - read_bytes){
+			length = size - read_bytes;
 		}
+		if(seek_chain(vol, index, &cursor, position / BLOCK_SIZE, 0) == 0){
+			uint8_t *data = get_block(vol, cursor.block);
+			if(data == NULL){
+				return -EIO;
+			}
+			memcpy(buf + read_bytes, data + count, length);
+			put_block(vol, data);
+		} else {
+			memset(buf + read_bytes, 0, length);
+		}
+		read_bytes += length;
 	}
 
-	int startBlock = 242 - index;
-	uint8_t timestamp[8];
-	generate_memefs_timestamp(timestamp);
+	if(file != NULL){
+		pthread_mutex_lock(&file->lock);
+		if(file->index == index){
+			file->cursor = cursor;
+		}
+		pthread_mutex_unlock(&file->lock);
+	}
+	return read_bytes;
+}
 
-	directory_blocks[index].type = S_IFREG | (mode & 0777);
-	while(main_FAT[startBlock] != 0){
-		if(startBlock > 255){
+/**
+ * Moves cursor to logical block target of file index. Returns 0 once it holds
+ * that block, 1 if target is in a hole or past the end (cursor on the block
+ * before), or an error. With allocate a zeroed block is linked in instead,
+ * splitting the hole: at most FAT_MAX_GAP blocks may lie between two blocks.
+ */
+static int seek_chain(volume_t *vol, int index, chain_cursor_t *cursor, uint32_t target, int allocate){
+	if(cursor->block < 0 || cursor->logical > target){
+		cursor->block = vol->directory_blocks[index].start_block;
+		cursor->logical = 0;
+	}
+	TRACE(chain_seek, vol->image, index, cursor->logical, target, allocate);
+	while(cursor->logical < target){
+		uint16_t value = vol->main_FAT[cursor->block];
+		TRACE(chain_step, vol->image, index, cursor->block, cursor->logical);
+		int linked = value != FAT_END && is_user_block(fat_next(value));
+		uint32_t next_logical = cursor->logical + 1 + fat_gap(value);
+		if(linked && next_logical <= target){
+			cursor->block = fat_next(value);
+			cursor->logical = next_logical;
+			continue;
+		}
+		if(!allocate){
+			return 1;
+		}
+		if(target - cursor->logical - 1 > FAT_MAX_GAP){
+			return -EFBIG;
+		}
+		int block = allocate_block(vol);
+		if(block < 0){
 			return -ENOSPC;
 		}
-		startBlock++;
+		uint8_t *data = new_block(vol, block);
+		if(data == NULL){
+			set_fat(vol, block, 0);
+			return -EIO;
+		}
+		put_block(vol, data);
+		if(linked){
+			set_fat(vol, block, fat_link(next_logical - target - 1, fat_next(value)));
+		}
+		set_fat(vol, cursor->block, fat_link(target - cursor->logical - 1, block));
+		cursor->block = block;
+		cursor->logical = target;
 	}
-	directory_blocks[index].start_block = startBlock;
-	memcpy(directory_blocks[index].filename, full + 1, 11);
-	directory_blocks[index].unused = 0;
-	directory_blocks[index].size = 0;
-	directory_blocks[index].ownerUID = getuid();
-	directory_blocks[index].groupGID = getgid();
+	return 0;
+}
 
-	for(int i = 0; i < 8; i++){
-		directory_blocks[index].timestamp[i] = timestamp[i];
+/**
+ * Writes size bytes at offset of file index, allocating blocks for holes and
+ * past the end as it goes. The cursor is left on the last block written.
+ * Returns the bytes written, short or an error when space runs out.
+ */
+static int write_file(volume_t *vol, int index, chain_cursor_t *cursor, off_t offset, const char *buf, size_t size){
+        size_t write_count = 0;
+	int error = 0;
+
+	while(write_count < size){
+		uint32_t position = offset + write_count;
+		error = seek_chain(vol, index, cursor, position / BLOCK_SIZE, 1);
+		if(error != 0){
+			break;
+		}
+		uint8_t *data = get_block(vol, cursor->block);
+		if(data == NULL){
+			error = -EIO;
+			break;
+		}
+		size_t count = position % BLOCK_SIZE;
+		size_t length = BLOCK_SIZE - count;
+		if(length > size - write_count){
+			length = size - write_count;
+		}
+		memcpy(data + count, buf + write_count, length);
+		mark_block_dirty(vol, cursor->block);
+		put_block(vol, data);
+		write_count += length;
 	}
+	if(write_count == 0 && size > 0){
+		return error;
+	}
+	if(offset + write_count > vol->directory_blocks[index].size){
+		vol->directory_blocks[index].size = offset + write_count;
+		mark_dirent_dirty(vol, index);
+	}
+	start_writeback(vol);
 
-	main_FAT[startBlock] = 0xFFFF;
-	backup_FAT[startBlock] = 0xFFFF;
-	fi->fh = index;
+	return write_count;
+}
 
-	printf("End of create\n");
+/**
+ * Cuts file index down to size bytes: blocks past the new end are freed and
+ * the rest of the new last block is zeroed, so growing it again reads zeros.
+ * The start block is always kept, and a new end inside a hole gets a block.
+ */
+static int shrink_file(volume_t *vol, int index, uint32_t size){
+	uint32_t last = size > 0 ? (size - 1) / BLOCK_SIZE : 0;
+	chain_cursor_t cursor = { -1, 0 };
+	int found = seek_chain(vol, index, &cursor, last, 0) == 0;
+
+	uint16_t value = vol->main_FAT[cursor.block];
+	if(value != FAT_END){
+		set_fat(vol, cursor.block, FAT_END);
+		for(int block = fat_next(value); is_user_block(block); ){
+			int next = fat_next(vol->main_FAT[block]);
+			set_fat(vol, block, 0);
+			block = next;
+		}
+	}
+	if(!found){
+		return seek_chain(vol, index, &cursor, last, 1);
+	}
+	uint32_t used = size - (last * BLOCK_SIZE);
+	if(used < BLOCK_SIZE){
+		uint8_t *data = get_block(vol, cursor.block);
+		if(data == NULL){
+			return -EIO;
+		}
+		memset(data + used, 0, BLOCK_SIZE - used);
+		mark_block_dirty(vol, cursor.block);
+		put_block(vol, data);
+	}
 	return 0;
 }
 
-static int memefs_unlink(const char *path){
-	int index = -1;
-	char full[13];
-        memset(full, '\0', 13);
+static int open_handle(volume_t *vol, int index, struct fuse_file_info *fi){
+	//Read-only handles never buffer and are not listed, open and release touch no shared state
+	open_file_t *file = malloc(options.read_only ? offsetof(open_file_t, buffer) : sizeof(open_file_t));
+
+	if(file == NULL){
+		return -ENOMEM;
+	}
+	file->index = index;
+	file->cursor.block = -1;
+	file->cursor.logical = 0;
+	file->buffer_offset = 0;
+	file->buffered = 0;
+	file->reserved = 0;
+	pthread_mutex_init(&file->lock, NULL);
+	file->next = NULL;
+	if(!options.read_only){
+		file->next = vol->open_files;
+		vol->open_files = file;
+	}
+	fi->fh = (uintptr_t) file;
+	return 0;
+}
 
-        int result = convert_filename(full, path);
+/**
+ * Writes out the buffered writes of one open file, with the volume lock and
+ * the file's lock held. Their blocks were reserved when they were buffered and
+ * are handed back just before, so write_file can allocate them.
+ */
+static int flush_file(volume_t *vol, open_file_t *file){
+	vol->reserved_blocks -= file->reserved;
+	file->reserved = 0;
+	if(file->buffered == 0){
+		return 0;
+	}
+	int written = write_file(vol, file->index, &file->cursor, file->buffer_offset, (const char *) file->buffer, file->buffered);
+	size_t buffered = file->buffered;
+	file->buffered = 0;
+	vol->slot_writer[file->index] = NULL;
+	if(written < 0){
+		return written;
+	}
+	return (size_t) written < buffered ? -ENOSPC : 0;
+}
 
-	if(result != 0){
+/**
+ * Flushes the buffered writes of a slot, so its size and contents are current.
+ * Called with the volume lock held and no open file's lock.
+ */
+static int flush_writes(volume_t *vol, int index){
+	open_file_t *writer = vol->slot_writer[index];
+	if(writer == NULL){
 		return 0;
 	}
+	pthread_mutex_lock(&writer->lock);
+	int error = flush_file(vol, writer);
+	pthread_mutex_unlock(&writer->lock);
+	return error;
+}
 
-	char original[14];
+static int memefs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	if(options.read_only){
+		return -EROFS;
+	}
+	if(offset < 0 || (uint64_t) offset + size > UINT32_MAX){
+		return -EFBIG;
+	}
 
-	for(int i = 0; i < 16 * 14; i++){
-                memset(original, '\0', 14);
-                reverse_conversion(directory_blocks[i].filename, original);
-		if(strcmp(original, path + 1) == 0){
-                        index = i;
+	open_file_t *file = fi != NULL ? (open_file_t *) (uintptr_t) fi->fh : NULL;
+	lock_volume(vol);
+	if(file == NULL){
+		int index = find_entry(vol, path);
+		chain_cursor_t cursor = { -1, 0 };
+		int result = index >= 0 ? flush_writes(vol, index) : -ENOENT;
+		if(result == 0){
+			result = write_file(vol, index, &cursor, offset, buf, size);
 		}
+		unlock_volume(vol);
+		return result;
+	}
+	//Another handle's pending writes go first, before this handle's lock so no two are held
+	int result = file->index < 0 ? -ENOENT : 0;
+	if(result == 0 && vol->slot_writer[file->index] != file){
+		result = flush_writes(vol, file->index);
 	}
+	if(result == 0){
+		pthread_mutex_lock(&file->lock);
+		result = buffer_write(vol, file, buf, size, offset);
+		pthread_mutex_unlock(&file->lock);
+	}
+	unlock_volume(vol);
+	return result;
+}
 
-	if(index == -1){
-		printf("Couldn't locate %s\n", path);
-		return -ENONET;
+/**
+ * Adds a write to the buffer of an open file, both locks held
+ */
+static int buffer_write(volume_t *vol, open_file_t *file, const char *buf, size_t size, off_t offset){
+
+	//Sequential writes are gathered, each batch ends on a block boundary
+	if(file->buffered > 0 && ((uint64_t) offset != file->buffer_offset + file->buffered ||
+		file->buffered + size > WRITE_BUFFER_SIZE - (file->buffer_offset % BLOCK_SIZE))){
+		int error = flush_file(vol, file);
+		if(error != 0){
+			return error;
+		}
+	}
+	if(file->buffered == 0){
+		file->buffer_offset = offset;
 	}
-	directory_blocks[index].type = 0;
-	strcpy(directory_blocks[index].filename, " ");
-	int nextFAT = directory_blocks[index].start_block;
-	int current;
-	do {
-		current = nextFAT;
-		nextFAT = main_FAT[current];
-		main_FAT[current] = 0;
-		backup_FAT[current] = 0;
-	} while(current != 0xFFFF);
 
-	for(int i = 0; i < 256; i++){
-		backup_FAT[i] = main_FAT[i];
+	//Buffered only once every block it touches is reserved, otherwise written straight through
+	//so running out of space fails here, as is a write past the end that opens a hole so a gap
+	//too long does
+	size_t limit = WRITE_BUFFER_SIZE - (file->buffer_offset % BLOCK_SIZE);
+	int needed = ((offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE) - (file->buffer_offset / BLOCK_SIZE);
+	if(size > limit || needed - file->reserved > vol->free_blocks - vol->reserved_blocks ||
+		file->buffer_offset > vol->directory_blocks[file->index].size){
+		int error = flush_file(vol, file);
+		if(error != 0){
+			return error;
+		}
+		return write_file(vol, file->index, &file->cursor, offset, buf, size);
 	}
-	return 0;
+	if(needed > file->reserved){
+		vol->reserved_blocks += needed - file->reserved;
+		file->reserved = needed;
+	}
+	memcpy(file->buffer + file->buffered, buf, size);
+	file->buffered += size;
+	vol->slot_writer[file->index] = file;
+	return size;
 }
 
-static int memefs_open(const char *path, struct fuse_file_info *fi){
-	char original[14];
-    	for(int i = 0; i < 224; i++){
-		memset(original, '\0', 14);
-                reverse_conversion(directory_blocks[i].filename, original);
+// Called with the volume lock held
+static int flush_handle(volume_t *vol, open_file_t *file){
+	int error = 0;
+
+	if(file != NULL && !options.read_only){
+		pthread_mutex_lock(&file->lock);
+		error = file->index >= 0 ? flush_file(vol, file) : 0;
+		pthread_mutex_unlock(&file->lock);
+	}
+	return error;
+}
 
-        	if(directory_blocks[i].type != 0 && strcmp(original, path + 1) == 0){
-			fi->fh = i;
-           		return 0;
-        	}
-    	}
+static int memefs_flush(const char *path, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	(void) path;
 
-	printf("Couldn't locate file\n");
-   	return -ENOENT;
+	lock_volume(vol);
+	int error = flush_handle(vol, fi != NULL ? (open_file_t *) (uintptr_t) fi->fh : NULL);
+	unlock_volume(vol);
+	return error;
 }
 
-static int memefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	(void) size;
-	(void) offset;
+static int memefs_release(const char *path, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	open_file_t *file = (open_file_t *) (uintptr_t) fi->fh;
+	(void) path;
+
+	lock_volume(vol);
+	int error = flush_handle(vol, file);
+	if(file != NULL && !options.read_only){
+		open_file_t **link = &vol->open_files;
+		while(*link != file){
+			link = &(*link)->next;
+		}
+		*link = file->next;
+	}
+	unlock_volume(vol);
+	if(file != NULL){
+		pthread_mutex_destroy(&file->lock);
+		free(file);
+		fi->fh = 0;
+	}
+	return error;
+}
+
+/**
+ * Growing a file leaves a hole, only the block holding the new last byte is
+ * allocated. Shrinking frees the blocks past the end.
+ */
+static int memefs_truncate(const char *path, off_t size, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
 	(void) fi;
 
-    	int index = -1;
-	char original[14];
-    	for(int i = 0; i < 224; i++){
-                memset(original, '\0', 14);
-                reverse_conversion(directory_blocks[i].filename, original);
-    		if(directory_blocks[i].type != 0 && strcmp(original, path + 1) == 0){
-			index = i;
-    		       	i = 224;
-    		}
-    	}
+	if(options.read_only){
+		return -EROFS;
+	}
+	if(size < 0 || (uint64_t) size > UINT32_MAX){
+		return -EFBIG;
+	}
+	lock_volume(vol);
+	int result = resize_file(vol, path, size);
+	unlock_volume(vol);
+	return result;
+}
 
+static int resize_file(volume_t *vol, const char *path, off_t size){
+	int index = find_entry(vol, path);
 	if(index == -1){
-		printf("Couldn't locate file\n");
 		return -ENOENT;
 	}
-
-	int count = 0;
-	int read_bytes = 0;
-	int FAT_loc = directory_blocks[index].start_block;
-
-	while(main_FAT[FAT_loc] != 0xFFFF){
-		buf[read_bytes++] = user_blocks[((FAT_loc - 19) * BLOCK_SIZE) + count++];
-		if(count == BLOCK_SIZE - 1){
-			FAT_loc = main_FAT[FAT_loc];
-			count = 0;
-		}
+	int error = flush_writes(vol, index);
+	if(error != 0){
+		return error;
 	}
 
-	while(user_blocks[((FAT_loc - 19) * BLOCK_SIZE) + count] != 0){
-		buf[read_bytes++] = user_blocks[((FAT_loc - 19) * BLOCK_SIZE) + count++];
+	uint32_t old_size = vol->directory_blocks[index].size;
+	if((uint32_t) size > old_size){
+		chain_cursor_t cursor = { -1, 0 };
+		error = seek_chain(vol, index, &cursor, (size - 1) / BLOCK_SIZE, 1);
+	} else if((uint32_t) size < old_size){
+		error = shrink_file(vol, index, size);
+		for(open_file_t *file = vol->open_files; file != NULL; file = file->next){
+			if(file->index == index){
+				pthread_mutex_lock(&file->lock);
+				file->cursor.block = -1;
+				pthread_mutex_unlock(&file->lock);
+			}
+		}
 	}
-
-	for(int i = 0; i < 256; i++){
-		backup_FAT[i] = main_FAT[i];
+	if(error != 0){
+		return error;
 	}
-
-	return read_bytes;
+	vol->directory_blocks[index].size = size;
+	mark_dirent_dirty(vol, index);
+	start_writeback(vol);
+	return 0;
 }
 
-static int memefs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	(void) offset;
+/**
+ * Answers SEEK_DATA and SEEK_HOLE from the chain, the end of the file counts as a hole
+ */
+static off_t memefs_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
 	(void) fi;
 
-    	int index = -1;
-	char original[14];
-    	for(int i = 0; i < 224; i++){
-		memset(original, '\0', 14);
-                reverse_conversion(directory_blocks[i].filename, original);
-    		if(directory_blocks[i].type != 0 && strcmp(original, path + 1) == 0){
-			index = i;
-    	       		i = 224;
-    	    	}
-    	}
+	if(whence != SEEK_DATA && whence != SEEK_HOLE){
+		return -EINVAL;
+	}
+	lock_volume(vol);
+	off_t result = seek_data(vol, path, offset, whence);
+	unlock_volume(vol);
+	return result;
+}
 
+static off_t seek_data(volume_t *vol, const char *path, off_t offset, int whence){
+	int index = find_entry(vol, path);
 	if(index == -1){
-		printf("Couldn't find file\n");
-    		return -ENOENT;
-    	}
-
-        int FAT_loc = directory_blocks[index].start_block;
-
-	while(main_FAT[FAT_loc] != 0xFFFF){
-		FAT_loc = main_FAT[FAT_loc];
-        }
-
-	int count = 0;
-        int write_count = 0;
-
-	while(user_blocks[((FAT_loc - 19) * BLOCK_SIZE) + count] != 0){
-        	count++;
-	}
-
-	int req;
-	int prev;
-	int start = FAT_loc;
-	int counter = 1;
-
-	if((size_t) count + size > BLOCK_SIZE - 1){
-		req = size / BLOCK_SIZE;
-		while(req > 0 && counter < 220){
-                	if(user_blocks[counter * BLOCK_SIZE] == 0){
-				prev = FAT_loc;
-				FAT_loc = counter + 19;
-                	        main_FAT[prev] = FAT_loc;
-				backup_FAT[prev] = FAT_loc;
-				main_FAT[FAT_loc] = 0xFFFF;
-				backup_FAT[FAT_loc] = 0xFFFF;
-                		req--;
-			}
-			counter++;
-		}
-
-        	if(req > 0){
-                	printf("There is no space\n");
-                	return -ENFILE; // ignore
-        	}
+		return -ENOENT;
+	}
+	int error = flush_writes(vol, index);
+	if(error != 0){
+		return error;
 	}
-	FAT_loc = start;
 
-	printf("After linking\n");
-	while((size_t)write_count < size){
-		printf("FAT_loc: %d  index: %d\n", FAT_loc, index);
-		user_blocks[((FAT_loc - 19) * BLOCK_SIZE) + count++] = buf[write_count++];
-		directory_blocks[index].size++;
-		if(count > BLOCK_SIZE){
-			FAT_loc = main_FAT[FAT_loc];
-			count = 0;
+	uint32_t size = vol->directory_blocks[index].size;
+	if(offset < 0 || (uint64_t) offset >= size){
+		return -ENXIO;
+	}
+	chain_cursor_t cursor = { -1, 0 };
+	for(uint32_t logical = offset / BLOCK_SIZE; (uint64_t) logical * BLOCK_SIZE < size; logical++){
+		int hole = seek_chain(vol, index, &cursor, logical, 0) != 0;
+		if(hole == (whence == SEEK_HOLE)){
+			off_t found = (off_t) logical * BLOCK_SIZE;
+			return found > offset ? found : offset;
 		}
 	}
+	return whence == SEEK_HOLE ? (off_t) size : -ENXIO;
+}
 
-	for(int i = 0; i < 256; i++){
-		backup_FAT[i] = main_FAT[i];
-	}
+static int memefs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+        (void) fi;
+        (void) tv;
 
-	printf("End of write\n");
-	return write_count;
+	if(options.read_only){
+		return -EROFS;
+	}
+	lock_volume(vol);
+	int i = find_entry(vol, path);
+	if(i >= 0){
+		generate_memefs_timestamp(vol->directory_blocks[i].timestamp);
+		mark_dirent_dirty(vol, i);
+	}
+	unlock_volume(vol);
+	return i >= 0 ? 0 : -ENOENT;
 }
 
-static int memefs_truncate(const char *path, off_t size, struct fuse_file_info *fi){
+/**
+ * Reports the user area and the directory from the free counters, no FAT scan
+ */
+static int memefs_statfs(const char *path, struct statvfs *stbuf){
+	volume_t *vol = current_volume();
 	(void) path;
-	(void) size;
-	(void) fi;
-	return 0; // truncating is implemented within write
-}
 
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = NUM_USER_BLOCKS;
+	stbuf->f_bfree = vol->free_blocks - vol->reserved_blocks;
+	stbuf->f_bavail = vol->free_blocks - vol->reserved_blocks;
+	stbuf->f_files = 16 * 14;
+	stbuf->f_ffree = vol->free_slots;
+	stbuf->f_favail = vol->free_slots;
+	stbuf->f_namemax = 12;
+	return 0;
+}
 
-static int memefs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi){
-        (void) fi;
-        (void) tv;
+static int memefs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	volume_t *vol = current_volume();
+	(void) datasync;
 
-	char original[14];
-        for(int i = 0; i < 224; i++){
-		memset(original, '\0', 14);
-                reverse_conversion(directory_blocks[i].filename, original);
-                if(directory_blocks[i].type != 0 && strcmp(original, path + 1) == 0){
-			generate_memefs_timestamp(directory_blocks[i].timestamp);
-                       	return 0;
-		}
-        }
-        return -ENOENT;
+	if(options.read_only){
+		return 0; //nothing is ever dirty
+	}
+	(void) path;
+	lock_volume(vol);
+	int error = flush_handle(vol, fi != NULL ? (open_file_t *) (uintptr_t) fi->fh : NULL);
+	int result = commit_memefs(vol, 0);
+	unlock_volume(vol);
+	return error != 0 ? error : result;
 }
 
 /**
  * Copies signature information from image if version is 1, intializes variables
+ * If the image was not cleanly unmounted the intent log is replayed first
  */
-static int mount_memefs(){
-	char pathInfo[]  = "myfilesystem.img";
-       	abs_path = realpath(pathInfo, NULL);
-
-	FILE* filesystem = fopen(abs_path, "rb");
-
-	if(filesystem == NULL){
-		perror("Mount memefs fopen\n");
-	}
-
-	int file_des = fileno(filesystem);
-	int i = 0;
-	uint16_t temp;
-	uint32_t big_temp;
-	pread(file_des, &main_superblock.signature, 16, (255 * BLOCK_SIZE) + i); // string
-	i+=16;
-	main_superblock.cleanly_unmounted = 0xFF;
-	i++;
-        //reserved bytes
-	for(int j = 0; j < 3; j++){
-		main_superblock.reserved_bytes[j] = 0;
-	}
-	i+=3;
-	pread(file_des, &big_temp, 4, (255 * BLOCK_SIZE) + i);
-    	main_superblock.fs_version = ntohl(big_temp);
-	i+=4;
-	for(int j = 0; j < 8; j++){
-        	pread(file_des, &temp, 1, (255 * BLOCK_SIZE) + i);
-       		main_superblock.fs_ctime[j] = temp;
-		i++;
-	}
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.main_fat = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.main_fat_size = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.backup_fat = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.backup_fat_size = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.directory_start = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.directory_size = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.num_user_blocks = ntohs(temp);
-	i+=2;
-        pread(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);
-        main_superblock.first_user_block = ntohs(temp);
-	i+=2;
-        pread(file_des, &main_superblock.volume_label, 16, (255 * BLOCK_SIZE) + i); //string
-	i+=16;
-      	//unused bytes
-	for(int j = 0; j < 448; j++){
-		main_superblock.unused[j] = 0;
-	}
-	backup_superblock = main_superblock;
-	i = 0;
-	//FAT
-	for(int j = 0; j < 256; j++){
-		pread(file_des, &temp, 2, (254 * BLOCK_SIZE) + i);
-		main_FAT[j] = ntohs(temp);
-		i+=2;
-	}
-	i = 0;
-	//Backup FAT
-	for(int j = 0; j < 256; j++){
-		pread(file_des, &temp, 2, (239 * BLOCK_SIZE) + i);
-		backup_FAT[j] = ntohs(temp);
-		i+=2;
-	}
-	if(main_superblock.fs_version == 1){
+static int mount_memefs(volume_t *vol){
+	vol->abs_path = realpath(vol->image, NULL);
+
+	if(vol->abs_path == NULL){
+		perror("Mount memefs realpath\n");
+		return -ENOENT;
+	}
+
+	int file_des = open(vol->abs_path, options.read_only ? O_RDONLY : O_RDWR);
+
+	if(file_des < 0){
+		perror("Mount memefs open\n");
+		free(vol->abs_path);
+		return -ENOENT;
+	}
+	vol->image_fd = file_des;
+	//A read-only volume is always served straight from a shared mapping
+	if((options.mmap || options.read_only) && map_image(vol) != 0){
+		perror("Mount memefs mmap\n");
+		close(file_des);
+		vol->image_fd = -1;
+		free(vol->abs_path);
+		return -EIO;
+	}
+	if(vol->image_map == NULL){
+		open_data_fd(vol);
+	}
+
+	//Superblock is read and decoded as one block
+	uint8_t block[BLOCK_SIZE];
+	uint8_t fat_backup[BLOCK_SIZE];
+	TRACE(mount, vol->image, options.read_only);
+	TRACE(image_read, vol->image, 255 * BLOCK_SIZE, BLOCK_SIZE);
+	if(pread(file_des, block, BLOCK_SIZE, 255 * BLOCK_SIZE) != BLOCK_SIZE){
+		perror("Mount memefs superblock\n");
+		close_data_fd(vol);
+		unmap_image(vol);
+		close(file_des);
+		vol->image_fd = -1;
+		free(vol->abs_path);
+		return -EIO;
+	}
+	decode_superblock(&vol->main_superblock, block);
+	int crashed = vol->main_superblock.cleanly_unmounted == MEMEFS_DIRTY;
+	if(crashed && options.read_only){
+		fprintf(stderr, "%s was not cleanly unmounted, mount it read-write once to recover it\n", vol->image);
+		unmap_image(vol);
+		close(file_des);
+		vol->image_fd = -1;
+		free(vol->abs_path);
+		return -EROFS;
+	}
+	vol->main_superblock.cleanly_unmounted = MEMEFS_DIRTY;
+	memset(vol->main_superblock.reserved_bytes, 0, sizeof(vol->main_superblock.reserved_bytes));
+	memset(vol->main_superblock.unused, 0, sizeof(vol->main_superblock.unused));
+	vol->backup_superblock = vol->main_superblock;
+	//FAT and directory are read as whole blocks, a mapped image already holds them
+	if(vol->image_map == NULL){
+		TRACE(image_read, vol->image, 240 * BLOCK_SIZE, 15 * BLOCK_SIZE);
+		pread(file_des, vol->disk_FAT, BLOCK_SIZE, 254 * BLOCK_SIZE);
+		pread(file_des, vol->disk_directory, 14 * BLOCK_SIZE, 240 * BLOCK_SIZE);
+	}
+
+	//The checksum table is only current on a clean image, after a crash it is rebuilt below
+	int checksummed = (vol->main_superblock.features & MEMEFS_CHECKSUMS) != 0;
+	const uint8_t *fat_image = vol->disk_FAT;
+	vol->checksums = 0;
+	vol->log_capacity = checksummed ? LOG_CAPACITY_CHECKSUMS : LOG_CAPACITY;
+	memset(vol->block_verified, 0, sizeof(vol->block_verified));
+	if(checksummed && !crashed){
+		int intact = verify_metadata(vol, file_des, block, fat_backup);
+		if(intact < 0){
+			fprintf(stderr, "%s: metadata does not match its checksums, see memefs-inspect -s\n", vol->image);
+			close_data_fd(vol);
+			unmap_image(vol);
+			close(file_des);
+			vol->image_fd = -1;
+			free(vol->abs_path);
+			return -EIO;
+		}
+		if(intact == 1 && !options.read_only){
+			memcpy(vol->disk_FAT, fat_backup, BLOCK_SIZE); //the next checkpoint rewrites the main FAT
+		} else if(intact == 1){
+			fat_image = fat_backup;
+		}
+	}
+
+	//A clean image has identical FATs, only a crashed one needs the backup
+	if(crashed){
+		uint8_t backup_image[BLOCK_SIZE];
+		TRACE(image_read, vol->image, 239 * BLOCK_SIZE, BLOCK_SIZE);
+		pread(file_des, backup_image, BLOCK_SIZE, 239 * BLOCK_SIZE);
+		int replayed = replay_log(vol, file_des);
+		fprintf(stderr, "memefs: %s was not cleanly unmounted, replayed %d log records\n", vol->image, replayed);
+		decode_fat(vol->backup_FAT, backup_image);
+		decode_fat(vol->main_FAT, vol->disk_FAT);
+	} else if(options.read_only){
+		decode_fat(vol->main_FAT, fat_image); //no log and no backup FAT to keep in sync
+	} else {
+		load_log_header(vol, file_des);
+		decode_fat(vol->main_FAT, fat_image);
+		memcpy(vol->backup_FAT, vol->main_FAT, sizeof(vol->main_FAT));
+	}
+	if(vol->main_superblock.fs_version == 1 && !crashed){
 		//intialize vars
 		//DIRECTORY
 		for(int j = 0; j < 16 * 14; j++){
-			directory_blocks[j].type = 0;
-			directory_blocks[j].start_block = -1;
-			strcpy(directory_blocks[j].filename, " ");
-			directory_blocks[j].unused = 0;
-			directory_blocks[j].timestamp[0] = 0;
-                        directory_blocks[j].timestamp[1] = 0;
-                        directory_blocks[j].timestamp[2] = 0;
-                        directory_blocks[j].timestamp[3] = 0;
-                        directory_blocks[j].timestamp[4] = 0;
-                        directory_blocks[j].timestamp[5] = 0;
-                        directory_blocks[j].timestamp[6] = 0;
-                        directory_blocks[j].timestamp[7] = 0;
-			directory_blocks[j].size = 0;
-			directory_blocks[j].ownerUID = -1;
-			directory_blocks[j].groupGID = -1;
-		}
-		//USERBLOCKS
-		for(int j = 0; j < 220 * BLOCK_SIZE; j++){
-			user_blocks[j] = 0;
+			vol->directory_blocks[j].type = 0;
+			vol->directory_blocks[j].start_block = -1;
+			strcpy(vol->directory_blocks[j].filename, " ");
+			vol->directory_blocks[j].unused = 0;
+			vol->directory_blocks[j].timestamp[0] = 0;
+                        vol->directory_blocks[j].timestamp[1] = 0;
+                        vol->directory_blocks[j].timestamp[2] = 0;
+                        vol->directory_blocks[j].timestamp[3] = 0;
+                        vol->directory_blocks[j].timestamp[4] = 0;
+                        vol->directory_blocks[j].timestamp[5] = 0;
+                        vol->directory_blocks[j].timestamp[6] = 0;
+                        vol->directory_blocks[j].timestamp[7] = 0;
+			vol->directory_blocks[j].size = 0;
+			vol->directory_blocks[j].ownerUID = -1;
+			vol->directory_blocks[j].groupGID = -1;
 		}
+		//USERBLOCKS are all free, each one is zeroed by new_block when allocated
 	} else {
-		i = 0;
 		//copy everything from img
 		//Directory
-		for(int j = 0; j < 16 * 14; j++){
-			pread(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-			directory_blocks[j].type = ntohs(temp);
-			i+=2;
-                        pread(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-                	directory_blocks[j].start_block = ntohs(temp);
-			i+=2;
-                        pread(file_des, &directory_blocks[j].filename, 11, (240 * BLOCK_SIZE) + i);
-			i+=11;
-                        directory_blocks[j].unused = 0;//unused
-			i++;
-			for(int k = 0; k < 8; k++){
-                        	pread(file_des, &temp, 1, (240 * BLOCK_SIZE) + i);
-                		directory_blocks[j].timestamp[k] = temp;
-				i++;
+		decode_directory(vol->directory_blocks, vol->disk_directory, 16 * 14);
+		//User Blocks are read on first use unless lazy_load is off and they all fit in the cache
+		if(vol->image_map != NULL){
+			if(!options.lazy_load){
+				madvise(vol->image_map + (FIRST_USER_BLOCK * BLOCK_SIZE), NUM_USER_BLOCKS * BLOCK_SIZE, MADV_WILLNEED);
 			}
-                        pread(file_des, &big_temp, 4, (240 * BLOCK_SIZE) + i);
-                	directory_blocks[j].size = ntohl(big_temp);
-			i+=4;
-                        pread(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-                	directory_blocks[j].ownerUID = ntohs(temp);
-			i+=2;
-                        pread(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-                	directory_blocks[j].groupGID = ntohs(temp);
-			i+=2;
-		}
-		//User Blocks
-		i = 0;
-		for(int j = 0; j < 220 * BLOCK_SIZE; j++){
-			pread(file_des, &temp, 1, (19 * BLOCK_SIZE) + i);
-			user_blocks[j] = temp;
-			i++;
-		}
-	}
-	fclose(filesystem);
+		} else if(!options.lazy_load && load_user_blocks(vol) != 0){
+			perror("Mount memefs user blocks\n");
+			close_data_fd(vol);
+			unmap_image(vol);
+			close(file_des);
+			vol->image_fd = -1;
+			free(vol->abs_path);
+			return -EIO;
+		}
+	}
+	memset(vol->dir_used, 0, sizeof(vol->dir_used));
+	vol->free_slots = 16 * 14;
+	for(int j = 0; j < 16 * 14; j++){
+		index_dirent(vol, j);
+	}
+	vol->free_blocks = 0;
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		vol->free_blocks += vol->main_FAT[block] == 0;
+	}
+
+	if(options.read_only){
+		if(options.checksums && !checksummed){
+			fprintf(stderr, "%s has no checksums, mount it read-write with -o checksums to add them\n", vol->image);
+		}
+		return 0; //the image is never written
+	}
+
+	//Mark the image as mounted and start a fresh log generation
+	uint8_t flag = MEMEFS_DIRTY;
+	TRACE(image_write, vol->image, (255 * BLOCK_SIZE) + 16, 1);
+	TRACE(image_write, vol->image, (0 * BLOCK_SIZE) + 16, 1);
+	pwrite(file_des, &flag, 1, (255 * BLOCK_SIZE) + 16);
+	pwrite(file_des, &flag, 1, (0 * BLOCK_SIZE) + 16);
+	//After a crash the table may not match what reached the disk, -o checksums starts one
+	if((checksummed && crashed) || (options.checksums && !checksummed)){
+		if(rebuild_checksums(vol) == 0){
+			vol->main_superblock.features |= MEMEFS_CHECKSUMS;
+		} else {
+			fprintf(stderr, "%s: could not checksum the user blocks, checksums are off\n", vol->image);
+			vol->main_superblock.features &= ~MEMEFS_CHECKSUMS;
+		}
+		vol->backup_superblock.features = vol->main_superblock.features;
+	}
+	if(crashed){
+		recover_memefs(vol);
+		commit_memefs(vol, 1);
+	} else {
+		reset_log(vol);
+	}
 	return 0;
 }
 
-static int unmount_memefs(){
-   	FILE* filesystem = fopen(abs_path, "rb+");
-	if(filesystem == NULL){
-                perror("Unmount memefs fopen\n");
+static int unmount_memefs(volume_t *vol){
+	int file_des = vol->image_fd;
+	if(file_des < 0){
 		return -ENONET;
 	}
+	TRACE(unmount, vol->image, options.read_only);
+	forget_prefetch(vol);
+	if(options.read_only){
+		//Nothing changed, the image and its fs_version are left as they are
+		unmap_image(vol);
+		close(file_des);
+		vol->image_fd = -1;
+		free(vol->abs_path);
+		return 0;
+	}
+	for(open_file_t *file = vol->open_files; file != NULL; file = file->next){
+		if(file->index >= 0){
+			flush_file(vol, file);
+		}
+	}
 
-	int file_des = fileno(filesystem);
-	//Superblock
-	int i = 0;
-	uint16_t temp;
-	uint32_t big_temp;
-
-	main_superblock.cleanly_unmounted = 0;
-	backup_superblock.cleanly_unmounted = 0;
-
-	pwrite(file_des, &main_superblock.signature, 16, (255 * BLOCK_SIZE) + i); //signature
-	i+=16;
-	temp = main_superblock.cleanly_unmounted;
-        pwrite(file_des, &temp, 1, (255 * BLOCK_SIZE) + i); //mounted flag
-	i++;
-	for(int j = 0; j < 3; j++){
-		temp = main_superblock.reserved_bytes[j];
-		pwrite(file_des, &temp, 1, (255 * BLOCK_SIZE) + i);
-		i++;
-	}
-	big_temp = htonl(main_superblock.fs_version + 1);
-	pwrite(file_des, &big_temp, 4, (255 * BLOCK_SIZE) + i); //version
-	i+=4;
-	for(int j = 0; j < 8; j++){
-		temp = main_superblock.fs_ctime[j];
-        	pwrite(file_des, &temp, 1, (255 * BLOCK_SIZE) + i);//BCD
-		i++;
-	}
-	temp = htons(main_superblock.main_fat);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//main FAT loc
-	i+=2;
-	temp = htons(main_superblock.main_fat_size);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//main FAT size
-        i+=2;
-	temp = htons(main_superblock.backup_fat);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//backup FAT loc
-        i+=2;
-	temp = htons(main_superblock.backup_fat_size);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//backup FAT size
-        i+=2;
-	temp = htons(main_superblock.directory_start);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//directory loc
-        i+=2;
-	temp = htons(main_superblock.directory_size);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//directory size
-        i+=2;
-	temp = htons(main_superblock.num_user_blocks);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//userblock  count
-        i+=2;
-	temp = htons(main_superblock.first_user_block);
-        pwrite(file_des, &temp, 2, (255 * BLOCK_SIZE) + i);//first user block
-        i+=2;
-        pwrite(file_des, &main_superblock.volume_label, 16, (255 * BLOCK_SIZE) + i); //volume label
-	i+=16;
-        //unused
-	for(int j = 0; j < 448; j++){
-		temp = 0;
-		pwrite(file_des, &temp, 1, (255 * BLOCK_SIZE) + i);
-		i++;
-	}
-	//Backup Superblock
-	i = 0;
-	pwrite(file_des, &backup_superblock.signature, 16, (0 * BLOCK_SIZE) + i); //writing the same signature to backup superblock
-	i+=16;
-	temp = backup_superblock.cleanly_unmounted;
-        pwrite(file_des, &temp, 1, (0 * BLOCK_SIZE) + i); //mounted flag
-	i++;
-	for(int j = 0; j < 3; j++){
-		temp = 0;
-		pwrite(file_des, &temp, 1, (0 * BLOCK_SIZE) + i);
-		i++;
-	}
-	big_temp = htonl(backup_superblock.fs_version);
-	pwrite(file_des, &big_temp, 4, (0 * BLOCK_SIZE) + i); //version
-	i+=4;
-	for(int j = 0; j < 8; j++){
-		temp = backup_superblock.fs_ctime[j];
-        	pwrite(file_des, &temp, 1, (0 * BLOCK_SIZE) + i);//BCD
-		i++;
-	}
-	temp = htons(backup_superblock.main_fat);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//main FAT loc
-	i+=2;
-	temp = htons(backup_superblock.main_fat_size);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//main FAT size
-        i+=2;
-	temp = htons(backup_superblock.backup_fat);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//backup FAT loc
-        i+=2;
-	temp = htons(backup_superblock.backup_fat_size);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//backup FAT size
-        i+=2;
-	temp = htons(backup_superblock.directory_start);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//directory loc
-        i+=2;
-	temp = htons(backup_superblock.directory_size);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//directory size
-        i+=2;
-	temp = htons(backup_superblock.num_user_blocks);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//userblock  count
-        i+=2;
-	temp = htons(backup_superblock.first_user_block);
-        pwrite(file_des, &temp, 2, (0 * BLOCK_SIZE) + i);//first user block
-        i+=2;
-        pwrite(file_des, &backup_superblock.volume_label, 16, (0 * BLOCK_SIZE) + i); //volume label
-	i+=16;
-        //unused
-	for(int j = 0; j < 448; j++){
-		temp = 0;
-		pwrite(file_des, &temp, 1, (0 * BLOCK_SIZE) + i);
-		i++;
-	}
-	//FAT
-	i = 0;
-	for(int j = 0; j < 256; j++){
-		temp = htons(main_FAT[j]);
-		pwrite(file_des, &temp, 2, (254 * BLOCK_SIZE) + i);
-		i+=2;
-	}
-	//Backup FAT
-	i = 0;
-	for(int j = 0; j < 256; j++){
-		temp = htons(backup_FAT[j]);
-		pwrite(file_des, &temp, 2, (239 * BLOCK_SIZE) + i);
-		i+=2;
-	}
-	//Single Directory Blocks
-	i = 0;
-	for(int j = 0; j < 16 * 14; j++){
-		temp = htons(directory_blocks[j].type);
-		pwrite(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-		i+=2;
-		temp = htons(directory_blocks[j].start_block);
-		pwrite(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-		i+=2;
-		pwrite(file_des, &directory_blocks[j].filename, 11, (240 * BLOCK_SIZE) + i);
-		i+=11;
-		temp = 0;
-		pwrite(file_des, &temp, 1, (240 * BLOCK_SIZE) + i);
-		i++; // unused
-		for(int k = 0; k < 8; k++){
-			temp = directory_blocks[j].timestamp[k];
-			pwrite(file_des, &temp, 1, (240 * BLOCK_SIZE) + i);
-			i++;
-		}
-		big_temp = htonl(directory_blocks[j].size);
-		pwrite(file_des, &big_temp, 4, (240 * BLOCK_SIZE) + i);
-		i+=4;
-		temp = htons(directory_blocks[j].ownerUID);
-		pwrite(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-		i+=2;
-		temp = htons(directory_blocks[j].groupGID);
-		pwrite(file_des, &temp, 2, (240 * BLOCK_SIZE) + i);
-		i+=2;
-	}
-	//Reserved Blocks
-	i = 0;
-	for(int j = 0; j < 18 * BLOCK_SIZE; j++){
-		temp = 0;
-		pwrite(file_des, &temp, 1, (1 * BLOCK_SIZE) + i);
-		i++;
-	}
-	//User Data Blocks
-	i = 0;
-	for(int j = 0; j < 220 * BLOCK_SIZE; j++){
-		pwrite(file_des, &user_blocks[j], 1, (19 * BLOCK_SIZE) + i);
-		i++;
+	//Data, FAT, backup FAT and directory go out first through a checkpoint
+	if(commit_memefs(vol, 1) != 0){
+		perror("Unmount memefs commit\n");
+	}
+
+	//Superblocks are encoded into a block and written with one pwrite each,
+	//reserved and unused bytes were cleared at mount
+	uint8_t block[BLOCK_SIZE];
+	memefs_superblock_t superblock;
+
+	vol->main_superblock.cleanly_unmounted = 0;
+	vol->backup_superblock.cleanly_unmounted = 0;
+
+	superblock = vol->main_superblock;
+	superblock.fs_version = vol->main_superblock.fs_version + 1;
+	encode_superblock(block, &superblock);
+	checksum_block(vol, 255, block);
+	TRACE(image_write, vol->image, 255 * BLOCK_SIZE, BLOCK_SIZE);
+	pwrite(file_des, block, BLOCK_SIZE, 255 * BLOCK_SIZE);
+
+	superblock = vol->backup_superblock;
+	encode_superblock(block, &superblock);
+	checksum_block(vol, 0, block);
+	TRACE(image_write, vol->image, 0 * BLOCK_SIZE, BLOCK_SIZE);
+	pwrite(file_des, block, BLOCK_SIZE, 0 * BLOCK_SIZE);
+	if(write_checksums(vol) != 0){
+		perror("Unmount memefs checksums\n");
 	}
 	fsync(file_des);
-	fclose(filesystem);
-	free(abs_path);
-	printf("End of unmount\n");
+	release_slots(vol);
+	close_data_fd(vol);
+	unmap_image(vol);
+	close(file_des);
+	vol->image_fd = -1;
+	free(vol->abs_path);
 	return 0;
 }
 
-static int convert_filename(char* full, const char* path){
-	int period = 0;
-        int postPeriod = 0;
-        int difference;
-        int ext;
-
-        for(int i = 0; i < 12; i++){
-                if(period == 0 && i == 9){
-                	return EMSGSIZE;
-                }
-
-                if(path[i] == 46){
-                	period = 1;
-                    	if(strlen(path) - i > 4){
-                    		return EMSGSIZE;
-                    	}
-                    	ext = (strlen(path) - i - 2) * -1;
-                    	difference = (strlen(path) - i - (i - 5)) + ext + 2;
-                }
-
-                if(period == 0){
-                	full[i] = path[i];
-                }
-
-                if(period == 1 && postPeriod < 3){
-                	if(i != 9){
-          	        	full[i] = '\0';
-                    	}
-                	full[i + difference] = path[i + 1];
-                 	postPeriod++;
-                }
-        }
-	full[12] = '\0';
-	return 0;
-}
+/**
+ * Updates a FAT entry in both FATs and remembers it for the next commit
+ */
+static void set_fat(volume_t *vol, int block, uint16_t value){
+	if(is_user_block(block)){
+		vol->free_blocks += (value == 0) - (vol->main_FAT[block] == 0);
+		if(value == 0 && vol->main_FAT[block] != 0){
+			TRACE(free_block, vol->image, block, vol->free_blocks);
+		}
+	}
+	vol->main_FAT[block] = value;
+	vol->backup_FAT[block] = value;
+	vol->fat_dirty[block] = 1;
+}
+
+/**
+ * Returns the first free user block, already marked as the end of a chain,
+ * or -1 once every free block is reserved for buffered writes
+ */
+static int allocate_block(volume_t *vol){
+	if(vol->free_blocks <= vol->reserved_blocks){
+		TRACE(alloc_block, vol->image, -1, 0);
+		return -1;
+	}
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		if(vol->main_FAT[block] == 0){
+			set_fat(vol, block, 0xFFFF);
+			TRACE(alloc_block, vol->image, block, vol->free_blocks);
+			return block;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Remembers a changed entry for the next commit and refreshes its name key
+ */
+static void mark_dirent_dirty(volume_t *vol, int index){
+	vol->dirent_dirty[index] = 1;
+	index_dirent(vol, index);
+}
+
+static void index_dirent(volume_t *vol, int index){
+	uint64_t bit = 1ULL << (index % 64);
+
+	vol->free_slots += (vol->dir_used[index / 64] & bit) != 0;
+	memset(vol->dir_keys[index], 0, 16);
+	if(vol->directory_blocks[index].type != 0){
+		memcpy(vol->dir_keys[index], vol->directory_blocks[index].filename, 11);
+		format_filename((const char *) vol->dir_keys[index], vol->dir_names[index]);
+		vol->dir_used[index / 64] |= bit;
+		vol->free_slots--;
+	} else {
+		vol->dir_names[index][0] = '\0';
+		vol->dir_used[index / 64] &= ~bit;
+	}
+}
+
+static void fill_stat(volume_t *vol, int index, struct stat *stbuf){
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = index + 2; //the root is 1
+	stbuf->st_mode = vol->directory_blocks[index].type;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = vol->directory_blocks[index].size;
+	stbuf->st_uid = vol->directory_blocks[index].ownerUID;
+	stbuf->st_gid = vol->directory_blocks[index].groupGID;
+}
+
+/**
+ * Returns the slot of the file at path, or -1. Only slots in use are compared,
+ * each with one 16 byte compare.
+ */
+static int find_entry(volume_t *vol, const char *path){
+	uint8_t key[16] __attribute__((aligned(16)));
+
+	memset(key, 0, sizeof(key));
+	if(path[0] != '/' || make_filename((char *) key, path + 1) != 0){
+		return -1;
+	}
+#if MEMEFS_SIMD
+	__m128i wanted = _mm_load_si128((const __m128i *) key);
+#endif
+	for(int word = 0; word < DIR_WORDS; word++){
+		for(uint64_t bits = vol->dir_used[word]; bits != 0; bits &= bits - 1){
+			int index = (word * 64) + __builtin_ctzll(bits);
+#if MEMEFS_SIMD
+			__m128i name = _mm_load_si128((const __m128i *) vol->dir_keys[index]);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(name, wanted)) == 0xFFFF){
+				return index;
+			}
+#else
+			if(memcmp(vol->dir_keys[index], key, 16) == 0){
+				return index;
+			}
+#endif
+		}
+	}
+	return -1;
+}
+
+/**
+ * Returns the highest free slot, or -1 when the directory is full
+ */
+static int find_free_slot(volume_t *vol){
+	if(vol->free_slots == 0){
+		return -1;
+	}
+	for(int word = DIR_WORDS - 1; word >= 0; word--){
+		int slots = 16 * 14 - (word * 64);
+		uint64_t valid = slots >= 64 ? ~0ULL : (1ULL << slots) - 1;
+		uint64_t free_bits = ~vol->dir_used[word] & valid;
+		if(free_bits != 0){
+			TRACE(alloc_slot, vol->image, (word * 64) + 63 - __builtin_clzll(free_bits), vol->free_slots);
+			return (word * 64) + 63 - __builtin_clzll(free_bits);
+		}
+	}
+	return -1;
+}
+
+static void mark_block_dirty(volume_t *vol, int block){
+	pthread_mutex_lock(&cache_lock);
+	vol->block_dirty[block] = 1;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Maps the rings of a new io_uring instance, returns 0 or a negative errno
+ */
+static int ring_setup(unsigned entries){
+	struct io_uring_params params;
+	io_ring_t *ring = &io_ring;
+
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(fd < 0){
+		return -errno;
+	}
+	ring->fd = fd;
+	ring->sq_map_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	ring->cq_map_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		if(ring->cq_map_size > ring->sq_map_size){
+			ring->sq_map_size = ring->cq_map_size;
+		}
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED){
+		ring->sq_map = NULL;
+		return -errno;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED){
+			ring->cq_map = NULL;
+			return -errno;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED){
+		ring->sqes = NULL;
+		return -errno;
+	}
+
+	uint8_t *sq = ring->sq_map;
+	uint8_t *cq = ring->cq_map;
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	ring->queued = 0;
+	return 0;
+}
+
+static void ring_teardown(){
+	io_ring_t *ring = &io_ring;
+
+	if(ring->sqes != NULL){
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if(ring->cq_map != NULL && ring->cq_map != ring->sq_map){
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if(ring->sq_map != NULL){
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	if(ring->fd >= 0){
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/**
+ * Adds a readv/writev for the request to the submission queue, io_lock held
+ */
+static void ring_queue(io_request_t *req){
+	io_ring_t *ring = &io_ring;
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->volume->data_fd;
+	sqe->addr = (uintptr_t) req->iov;
+	sqe->len = req->blocks;
+	sqe->off = (uint64_t) req->first_block * BLOCK_SIZE;
+	sqe->user_data = (uintptr_t) req;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/**
+ * Submits the queued sqes, io_lock held
+ */
+static void ring_enter(){
+	io_ring_t *ring = &io_ring;
+	int result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+	if(result > 0){
+		ring->queued -= result;
+	}
+}
+
+static void io_complete(io_request_t *req, ssize_t result);
+
+/**
+ * Takes every completion the kernel has posted, io_lock held. At most
+ * IO_DEPTH requests are in flight, so that many fit in done and results.
+ */
+static int ring_reap(io_request_t **done, ssize_t *results){
+	io_ring_t *ring = &io_ring;
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int reaped = 0;
+
+	while(head != tail){
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		done[reaped] = (io_request_t *) (uintptr_t) cqe->user_data;
+		results[reaped++] = cqe->res;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+/**
+ * Waits for some request to complete, io_lock held. With io_uring a single
+ * reaper blocks in the kernel and completes what it reaped with io_lock
+ * dropped, so submitters are not held up; the other waiters sleep on io_done.
+ */
+static void io_await(){
+	io_ring_t *ring = &io_ring;
+	io_request_t *done[IO_DEPTH];
+	ssize_t results[IO_DEPTH];
+
+	if(io_backend != IO_URING){
+		pthread_cond_wait(&io_done, &io_lock);
+		return;
+	}
+	//Whatever is queued must be in the kernel before anyone waits for it
+	if(ring->queued > 0){
+		ring_enter();
+	}
+	if(ring->reaping){
+		pthread_cond_wait(&io_done, &io_lock);
+		return;
+	}
+	ring->reaping = 1;
+	pthread_mutex_unlock(&io_lock);
+	syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	pthread_mutex_lock(&io_lock);
+	int reaped = ring_reap(done, results);
+	pthread_mutex_unlock(&io_lock);
+	for(int j = 0; j < reaped; j++){
+		io_complete(done[j], results[j]);
+	}
+	pthread_mutex_lock(&io_lock);
+	ring->reaping = 0;
+	//Also wakes the waiters when nothing completed, one of them becomes the reaper
+	pthread_cond_broadcast(&io_done);
+}
+
+static ssize_t io_execute(io_request_t *req){
+	int fd = req->volume->data_fd;
+	off_t offset = (off_t) req->first_block * BLOCK_SIZE;
+	ssize_t result = req->write ? pwritev(fd, req->iov, req->blocks, offset) : preadv(fd, req->iov, req->blocks, offset);
+	return result < 0 ? -errno : result;
+}
+
+/**
+ * Finishes a request, called without io_lock or cache_lock. A failed write
+ * marks its blocks dirty again so the next flush retries them, a write's cache
+ * slots become reusable. The slot flags change under cache_lock like everywhere
+ * else, the request and batch under io_lock, one after the other.
+ */
+static void io_complete(io_request_t *req, ssize_t result){
+	int failed = result != (ssize_t) req->blocks * BLOCK_SIZE;
+
+	TRACE(io_complete, req->volume->image, req->write, req->first_block, req->blocks, (long) result);
+	if(req->write){
+		pthread_mutex_lock(&cache_lock);
+		for(int j = 0; j < req->blocks; j++){
+			cache_busy[((uint8_t *) req->iov[j].iov_base - cache_data) / BLOCK_SIZE] = 0;
+			if(failed){
+				req->volume->block_dirty[req->first_block + j] = 1;
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+	pthread_mutex_lock(&io_lock);
+	if(failed){
+		req->batch->error = -EIO;
+	}
+	req->batch->pending--;
+	req->in_use = 0;
+	io_in_flight--;
+	io_completed++;
+	pthread_cond_broadcast(&io_done);
+	pthread_mutex_unlock(&io_lock);
+}
+
+static void *io_worker(void *arg){
+	(void) arg;
+
+	pthread_mutex_lock(&io_lock);
+	while(io_threads_running){
+		io_request_t *req = io_queue_head;
+		if(req == NULL){
+			pthread_cond_wait(&io_work, &io_lock);
+			continue;
+		}
+		io_queue_head = req->next;
+		if(io_queue_head == NULL){
+			io_queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&io_lock);
+		io_complete(req, io_execute(req));
+		pthread_mutex_lock(&io_lock);
+	}
+	pthread_mutex_unlock(&io_lock);
+	return NULL;
+}
+
+/**
+ * Returns an unused request, waiting for one to complete when all are in flight.
+ * Like every wait for I/O it must not be called with cache_lock held.
+ */
+static io_request_t *io_get_request(){
+	pthread_mutex_lock(&io_lock);
+	while(1){
+		for(int j = 0; j < IO_DEPTH; j++){
+			if(!io_requests[j].in_use){
+				io_requests[j].in_use = 1;
+				io_requests[j].blocks = 0;
+				io_requests[j].next = NULL;
+				pthread_mutex_unlock(&io_lock);
+				return &io_requests[j];
+			}
+		}
+		io_await();
+	}
+}
+
+/**
+ * Gives back a request that was never submitted
+ */
+static void io_put_request(io_request_t *req){
+	pthread_mutex_lock(&io_lock);
+	req->in_use = 0;
+	pthread_cond_broadcast(&io_done);
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Hands a filled request to the backend. Without io_uring or running pool
+ * threads (before fuse_main forks) the request runs right away.
+ */
+static void io_submit(io_request_t *req, io_batch_t *batch){
+	TRACE(io_submit, req->volume->image, req->write, req->first_block, req->blocks);
+	pthread_mutex_lock(&io_lock);
+	req->batch = batch;
+	batch->pending++;
+	io_in_flight++;
+	if(io_backend == IO_URING){
+		ring_queue(req);
+	} else if(io_threads_running){
+		if(io_queue_tail != NULL){
+			io_queue_tail->next = req;
+		} else {
+			io_queue_head = req;
+		}
+		io_queue_tail = req;
+		pthread_cond_signal(&io_work);
+	} else {
+		pthread_mutex_unlock(&io_lock);
+		io_complete(req, io_execute(req));
+		return;
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Starts everything queued so far without waiting for it
+ */
+static void io_kick(){
+	pthread_mutex_lock(&io_lock);
+	if(io_backend == IO_URING && io_ring.queued > 0){
+		ring_enter();
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Waits for every request of a batch, returns 0 or -EIO if one of them failed
+ */
+static int io_wait(io_batch_t *batch){
+	pthread_mutex_lock(&io_lock);
+	while(batch->pending > 0){
+		io_await();
+	}
+	int error = batch->error;
+	batch->error = 0;
+	pthread_mutex_unlock(&io_lock);
+	return error;
+}
+
+/**
+ * Waits until some request in flight completes, whichever volume it belongs to.
+ * Returns 0 right away when nothing is in flight.
+ */
+static int io_wait_any(){
+	pthread_mutex_lock(&io_lock);
+	unsigned long completed = io_completed;
+	int waited = io_in_flight > 0;
+	while(io_in_flight > 0 && io_completed == completed){
+		io_await();
+	}
+	pthread_mutex_unlock(&io_lock);
+	return waited;
+}
+
+/**
+ * Picks the I/O backend shared by every volume
+ */
+static int io_setup(){
+	int result = ring_setup(IO_DEPTH);
+	if(result == 0){
+		io_backend = IO_URING;
+	} else {
+		ring_teardown();
+		io_backend = IO_POOL;
+		fprintf(stderr, "memefs: io_uring is not available (%s), using %d I/O threads\n", strerror(-result), IO_THREADS);
+	}
+	return 0;
+}
+
+/**
+ * Opens the descriptor a volume uses for user blocks.
+ * With odirect user blocks bypass the page cache, unless the image refuses
+ * 512 byte aligned direct I/O. The probe reads one block into a buffer that
+ * is only 512 byte aligned, as cache slots are.
+ */
+static void open_data_fd(volume_t *vol){
+	vol->data_fd = vol->image_fd;
+	if(options.odirect){
+		void *probe = NULL;
+		int fd = open(vol->abs_path, O_RDWR | O_DIRECT);
+		if(fd >= 0 && posix_memalign(&probe, 4096, 2 * BLOCK_SIZE) == 0 &&
+		   pread(fd, (uint8_t *) probe + BLOCK_SIZE, BLOCK_SIZE, FIRST_USER_BLOCK * BLOCK_SIZE) == BLOCK_SIZE){
+			vol->data_fd = fd;
+		} else {
+			fprintf(stderr, "memefs: O_DIRECT is not usable on %s, using buffered I/O\n", vol->image);
+			if(fd >= 0){
+				close(fd);
+			}
+		}
+		free(probe);
+	}
+}
+
+static void close_data_fd(volume_t *vol){
+	if(vol->data_fd >= 0 && vol->data_fd != vol->image_fd){
+		close(vol->data_fd);
+	}
+	vol->data_fd = -1;
+}
+
+/**
+ * Starts the pool threads, called from init once fuse_main no longer forks
+ */
+static void io_start_threads(){
+	if(io_backend != IO_POOL || io_threads_running){
+		return;
+	}
+	pthread_mutex_lock(&io_lock);
+	io_threads_running = 1;
+	pthread_mutex_unlock(&io_lock);
+	for(int j = 0; j < IO_THREADS; j++){
+		if(pthread_create(&io_threads[j], NULL, io_worker, NULL) != 0){
+			io_threads[j] = 0;
+		}
+	}
+}
+
+static void io_teardown(){
+	pthread_mutex_lock(&io_lock);
+	int running = io_threads_running;
+	io_threads_running = 0;
+	pthread_cond_broadcast(&io_work);
+	pthread_mutex_unlock(&io_lock);
+	for(int j = 0; running && j < IO_THREADS; j++){
+		if(io_threads[j]){
+			pthread_join(io_threads[j], NULL);
+		}
+	}
+	if(io_backend == IO_URING){
+		ring_teardown();
+	}
+	io_backend = IO_SYNC;
+}
+
+/**
+ * Submits a write for every run of dirty blocks whose slot is not already
+ * being written and marks those slots busy. Called without cache_lock, it is
+ * taken for each run once a request is free.
+ */
+static int submit_dirty_runs(volume_t *vol, io_batch_t *batch){
+	int block = FIRST_USER_BLOCK;
+	int submitted = 0;
+
+	while(1){
+		io_request_t *req = io_get_request();
+		pthread_mutex_lock(&cache_lock);
+		while(block < FIRST_USER_BLOCK + NUM_USER_BLOCKS &&
+		      (!vol->block_dirty[block] || vol->block_slot[block] < 0 || cache_busy[vol->block_slot[block]])){
+			block++;
+		}
+		req->write = 1;
+		req->volume = vol;
+		req->first_block = block;
+		while(req->blocks < IO_MAX_RUN && block < FIRST_USER_BLOCK + NUM_USER_BLOCKS &&
+		      vol->block_dirty[block] && vol->block_slot[block] >= 0 && !cache_busy[vol->block_slot[block]]){
+			int slot = vol->block_slot[block];
+			cache_busy[slot] = 1;
+			vol->block_dirty[block] = 0;
+			checksum_block(vol, block, cache_data + ((size_t) slot * BLOCK_SIZE));
+			req->iov[req->blocks].iov_base = cache_data + ((size_t) slot * BLOCK_SIZE);
+			req->iov[req->blocks].iov_len = BLOCK_SIZE;
+			req->blocks++;
+			block++;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		if(req->blocks == 0){
+			io_put_request(req);
+			return submitted;
+		}
+		io_submit(req, batch);
+		submitted++;
+	}
+}
+
+/**
+ * Writes dirty blocks in the background once enough have piled up,
+ * so the next commit only waits for what is left
+ */
+static void start_writeback(volume_t *vol){
+	int dirty = 0;
+
+	if(vol->image_map != NULL){
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		dirty += vol->block_dirty[block];
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if(dirty < WRITEBACK_THRESHOLD){
+		return;
+	}
+	if(submit_dirty_runs(vol, &vol->writeback_batch) > 0){
+		pthread_mutex_lock(&cache_lock);
+		vol->cache_unsynced = 1;
+		pthread_mutex_unlock(&cache_lock);
+	}
+	io_kick();
+}
+
+/**
+ * Allocates the slab of cache_blocks buffers shared by the volumes,
+ * enough for every user block of every volume by default
+ */
+static int init_cache(){
+	cache_hits = cache_misses = cache_evictions = cache_writebacks = 0;
+	if(options.mmap || options.read_only){
+		cache_slots = 0; //the page cache holds the blocks
+		return 0;
+	}
+	cache_slots = options.cache_blocks;
+	if(cache_slots <= 0 || cache_slots > NUM_USER_BLOCKS * num_volumes){
+		cache_slots = NUM_USER_BLOCKS * num_volumes;
+	}
+	//Page aligned so the buffers can be used for O_DIRECT
+	void *slab = NULL;
+	if(posix_memalign(&slab, 4096, (size_t) cache_slots * BLOCK_SIZE) != 0){
+		return -ENOMEM;
+	}
+	cache_data = slab;
+	cache_owner = calloc(cache_slots, sizeof(*cache_owner));
+	cache_block = malloc(cache_slots * sizeof(*cache_block));
+	cache_ref = calloc(cache_slots, 1);
+	cache_busy = calloc(cache_slots, 1);
+	cache_pins = calloc(cache_slots, sizeof(*cache_pins));
+	if(cache_owner == NULL || cache_block == NULL || cache_ref == NULL || cache_busy == NULL || cache_pins == NULL){
+		free_cache();
+		return -ENOMEM;
+	}
+	for(int slot = 0; slot < cache_slots; slot++){
+		cache_block[slot] = -1;
+	}
+	cache_used = 0;
+	cache_hand = 0;
+	return 0;
+}
+
+static void free_cache(){
+	if(cache_slots == 0){
+		return;
+	}
+	TRACE(cache_stats, cache_slots, cache_hits, cache_misses, cache_evictions, cache_writebacks);
+	free(cache_data);
+	free(cache_owner);
+	free(cache_block);
+	free(cache_ref);
+	free(cache_busy);
+	free(cache_pins);
+	cache_data = NULL;
+	cache_owner = NULL;
+	cache_block = NULL;
+	cache_ref = cache_busy = NULL;
+	cache_pins = NULL;
+	cache_slots = 0;
+}
+
+/**
+ * Gives the slots of an unmounted volume back to the others, its blocks are clean by now
+ */
+static void release_slots(volume_t *vol){
+	pthread_mutex_lock(&cache_lock);
+	for(int slot = 0; slot < cache_used; slot++){
+		if(cache_owner[slot] == vol){
+			cache_owner[slot] = NULL;
+			cache_block[slot] = -1;
+			cache_ref[slot] = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	for(int block = 0; block < 256; block++){
+		vol->block_slot[block] = -1;
+	}
+}
+
+/**
+ * Finds a slot for a block that is not cached: an unused one, else the CLOCK victim.
+ * Slots being written in the background or pinned by a copy are skipped, a dirty
+ * victim is written back before its buffer is reused.
+ * Without may_evict only unused slots are taken. Called with cache_lock held,
+ * which is dropped to wait for I/O or write a victim back: -EAGAIN then tells
+ * the caller to look the block up again, it may have been cached meanwhile.
+ */
+static int claim_slot(volume_t *vol, int block, int may_evict){
+	int slot;
+
+	if(cache_used < cache_slots){
+		slot = cache_used++;
+	} else if(!may_evict){
+		return -1;
+	} else {
+		int scanned = 0;
+		while(1){
+			if(++scanned > 2 * cache_slots){
+				//Every slot is busy, wait for a background write or let a copy finish
+				pthread_mutex_unlock(&cache_lock);
+				if(!io_wait_any()){
+					sched_yield();
+				}
+				pthread_mutex_lock(&cache_lock);
+				return -EAGAIN;
+			}
+			slot = cache_hand;
+			cache_hand = (cache_hand + 1) % cache_slots;
+			if(cache_busy[slot] || __atomic_load_n(&cache_pins[slot], __ATOMIC_ACQUIRE)){
+				continue;
+			}
+			if(cache_block[slot] < 0 || !cache_ref[slot]){
+				break;
+			}
+			cache_ref[slot] = 0;
+		}
+		//The victim may belong to any volume
+		int victim = cache_block[slot];
+		volume_t *owner = cache_owner[slot];
+		if(victim >= 0 && owner->block_dirty[victim]){
+			//Written back without cache_lock, the busy slot is left alone meanwhile
+			uint8_t *data = cache_data + ((size_t) slot * BLOCK_SIZE);
+			cache_busy[slot] = 1;
+			owner->block_dirty[victim] = 0;
+			owner->evicting++;
+			checksum_block(owner, victim, data);
+			pthread_mutex_unlock(&cache_lock);
+			TRACE(block_write, owner->image, victim);
+			int written = pwrite(owner->data_fd, data, BLOCK_SIZE, victim * BLOCK_SIZE) == BLOCK_SIZE;
+			pthread_mutex_lock(&cache_lock);
+			cache_busy[slot] = 0;
+			owner->evicting--;
+			pthread_cond_broadcast(&cache_evicted);
+			if(!written){
+				owner->block_dirty[victim] = 1;
+				return -1;
+			}
+			cache_writebacks++;
+			owner->cache_unsynced = 1;
+			//Still evictable unless it was used, dirtied or taken while the lock was dropped
+			if(vol->block_slot[block] >= 0 || owner->block_dirty[victim] || cache_ref[slot] ||
+			   cache_block[slot] != victim || cache_owner[slot] != owner || __atomic_load_n(&cache_pins[slot], __ATOMIC_ACQUIRE)){
+				return -EAGAIN;
+			}
+		}
+		if(victim >= 0){
+			owner->block_slot[victim] = -1;
+			cache_evictions++;
+		}
+	}
+	cache_owner[slot] = vol;
+	cache_block[slot] = block;
+	cache_ref[slot] = 1;
+	vol->block_slot[block] = slot;
+	return slot;
+}
+
+/**
+ * Returns the cached contents of a user block, reading it from the image on a miss.
+ * Without may_evict (prefetch) a miss only uses an unused slot and is not counted.
+ * A cached block stays pinned in its slot until put_block.
+ */
+static uint8_t *fetch_block(volume_t *vol, int block, int may_evict){
+	uint8_t *data = NULL;
+
+	if(vol->image_map != NULL){
+		data = vol->image_map + (block * BLOCK_SIZE);
+		//Readers of a read-only volume race here, checking a block twice is harmless
+		if(vol->checksums && !__atomic_load_n(&vol->block_verified[block], __ATOMIC_ACQUIRE)){
+			if(!block_intact(vol, block, data)){
+				return NULL;
+			}
+			__atomic_store_n(&vol->block_verified[block], 1, __ATOMIC_RELEASE);
+		}
+		return data;
+	}
+	pthread_mutex_lock(&cache_lock);
+	int slot = -EAGAIN;
+	int missed = 0;
+	while(slot == -EAGAIN){
+		slot = vol->block_slot[block];
+		missed = slot < 0;
+		if(missed){
+			slot = claim_slot(vol, block, may_evict);
+		}
+	}
+	if(slot >= 0 && !missed){
+		cache_ref[slot] = 1;
+		cache_hits += may_evict;
+		data = cache_data + ((size_t) slot * BLOCK_SIZE);
+	} else if(slot >= 0){
+		cache_misses += may_evict;
+		data = cache_data + ((size_t) slot * BLOCK_SIZE);
+		TRACE(block_read, vol->image, block);
+		if(pread(vol->data_fd, data, BLOCK_SIZE, block * BLOCK_SIZE) != BLOCK_SIZE || !block_intact(vol, block, data)){
+			cache_block[slot] = -1;
+			vol->block_slot[block] = -1;
+			data = NULL;
+		}
+	}
+	if(data != NULL){
+		__atomic_add_fetch(&cache_pins[slot], 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return data;
+}
+
+static uint8_t *get_block(volume_t *vol, int block){
+	return fetch_block(vol, block, 1);
+}
+
+/**
+ * Returns a block that was just allocated, zeroed instead of read from the image,
+ * pinned like get_block
+ */
+static uint8_t *new_block(volume_t *vol, int block){
+	uint8_t *data = NULL;
+
+	if(vol->image_map != NULL){
+		data = vol->image_map + (block * BLOCK_SIZE);
+		memset(data, 0, BLOCK_SIZE);
+		mark_block_dirty(vol, block);
+		vol->block_verified[block] = 1;
+		return data;
+	}
+	pthread_mutex_lock(&cache_lock);
+	int slot = -EAGAIN;
+	while(slot == -EAGAIN){
+		slot = vol->block_slot[block];
+		if(slot < 0){
+			slot = claim_slot(vol, block, 1);
+		}
+	}
+	if(slot >= 0){
+		data = cache_data + ((size_t) slot * BLOCK_SIZE);
+		memset(data, 0, BLOCK_SIZE);
+		vol->block_dirty[block] = 1;
+		__atomic_add_fetch(&cache_pins[slot], 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return data;
+}
+
+/**
+ * Ends a copy from or into a block returned by get_block or new_block, its slot
+ * may be reused from then on. Blocks written to must be marked dirty first.
+ */
+static void put_block(volume_t *vol, uint8_t *data){
+	if(vol->image_map == NULL){
+		__atomic_sub_fetch(&cache_pins[(data - cache_data) / BLOCK_SIZE], 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Reads every user block at once into unused slots, used when lazy_load is off.
+ * Does nothing when fewer than NUM_USER_BLOCKS slots are left, blocks are then read on first use.
+ */
+static int load_user_blocks(volume_t *vol){
+	int result = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	int first = cache_used;
+	if(cache_slots - first >= NUM_USER_BLOCKS){
+		uint8_t *data = cache_data + ((size_t) first * BLOCK_SIZE);
+		TRACE(image_read, vol->image, FIRST_USER_BLOCK * BLOCK_SIZE, NUM_USER_BLOCKS * BLOCK_SIZE);
+		if(pread(vol->data_fd, data, NUM_USER_BLOCKS * BLOCK_SIZE, FIRST_USER_BLOCK * BLOCK_SIZE) != NUM_USER_BLOCKS * BLOCK_SIZE){
+			result = -EIO;
+		} else {
+			for(int j = 0; j < NUM_USER_BLOCKS; j++){
+				//A damaged block is left out, reading it later fails
+				if(vol->main_FAT[FIRST_USER_BLOCK + j] != 0 && !block_intact(vol, FIRST_USER_BLOCK + j, data + (j * BLOCK_SIZE))){
+					cache_block[first + j] = -1;
+					continue;
+				}
+				cache_owner[first + j] = vol;
+				cache_block[first + j] = FIRST_USER_BLOCK + j;
+				vol->block_slot[FIRST_USER_BLOCK + j] = first + j;
+			}
+			cache_used += NUM_USER_BLOCKS;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return result;
+}
+
+/**
+ * Maps the whole image MAP_SHARED, the committed FAT and directory are then used in place
+ */
+static int map_image(volume_t *vol){
+	int protection = options.read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+	void *map = mmap(NULL, NUM_BLOCKS * BLOCK_SIZE, protection, MAP_SHARED, vol->image_fd, 0);
+	if(map == MAP_FAILED){
+		return -errno;
+	}
+	vol->image_map = map;
+	vol->disk_FAT = vol->image_map + (254 * BLOCK_SIZE);
+	vol->disk_directory = vol->image_map + (240 * BLOCK_SIZE);
+	return 0;
+}
+
+static void unmap_image(volume_t *vol){
+	if(vol->image_map != NULL){
+		munmap(vol->image_map, NUM_BLOCKS * BLOCK_SIZE);
+		vol->image_map = NULL;
+		vol->disk_FAT = vol->private_FAT;
+		vol->disk_directory = vol->private_directory;
+	}
+}
+
+/**
+ * Writes back part of the mapped image and waits for it, msync needs whole pages
+ */
+static int sync_map(volume_t *vol, int first_block, int blocks){
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = ((size_t) first_block * BLOCK_SIZE) & ~(page - 1);
+	size_t end = (size_t) (first_block + blocks) * BLOCK_SIZE;
+
+	TRACE(image_write, vol->image, start, end - start);
+	if(msync(vol->image_map + start, end - start, MS_SYNC)){
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Checks a block read from the image against its checksum, always true while the volume has none
+ */
+static int block_intact(volume_t *vol, int block, const uint8_t *data){
+	if(!vol->checksums || memefs_crc32c(data, BLOCK_SIZE) == vol->block_crc[block]){
+		return 1;
+	}
+	TRACE(checksum_error, vol->image, block);
+	fprintf(stderr, "%s: block %d does not match its checksum\n", vol->image, block);
+	return 0;
+}
+
+// Takes the checksum of a block that is about to be written to the image
+static void checksum_block(volume_t *vol, int block, const uint8_t *data){
+	if(vol->checksums){
+		vol->block_crc[block] = memefs_crc32c(data, BLOCK_SIZE);
+	}
+}
+
+/**
+ * Loads the checksum table of a cleanly unmounted image and checks the superblock,
+ * directory and FAT against it. A damaged main FAT may be replaced by the backup
+ * FAT, read into fat_backup. Returns 0, 1 when the backup FAT is to be used, or -EIO.
+ */
+static int verify_metadata(volume_t *vol, int file_des, const uint8_t *superblock, uint8_t *fat_backup){
+	uint32_t table[256];
+
+	TRACE(image_read, vol->image, CHECKSUM_BLOCK * BLOCK_SIZE, sizeof(table));
+	if(pread(file_des, table, sizeof(table), CHECKSUM_BLOCK * BLOCK_SIZE) != sizeof(table)){
+		return -EIO;
+	}
+	for(int block = 0; block < 256; block++){
+		vol->block_crc[block] = ntohl(table[block]);
+	}
+	vol->checksums = 1;
+
+	if(!block_intact(vol, 255, superblock)){
+		return -EIO;
+	}
+	for(int j = 0; j < 14; j++){
+		if(!block_intact(vol, 240 + j, vol->disk_directory + (j * BLOCK_SIZE))){
+			return -EIO;
+		}
+	}
+	if(block_intact(vol, 254, vol->disk_FAT)){
+		return 0;
+	}
+	TRACE(image_read, vol->image, 239 * BLOCK_SIZE, BLOCK_SIZE);
+	if(pread(file_des, fat_backup, BLOCK_SIZE, 239 * BLOCK_SIZE) != BLOCK_SIZE || !block_intact(vol, 239, fat_backup)){
+		return -EIO;
+	}
+	fprintf(stderr, "%s: main FAT is damaged, using the backup FAT\n", vol->image);
+	return 1;
+}
+
+/**
+ * Checksums every user block as it is in the image, when the table on disk is
+ * stale (after a crash) or missing (-o checksums on an image without one).
+ * Metadata is checksummed when the next checkpoint writes it.
+ */
+static int rebuild_checksums(volume_t *vol){
+	uint8_t *blocks;
+
+	if(vol->image_map != NULL){
+		blocks = vol->image_map + (FIRST_USER_BLOCK * BLOCK_SIZE);
+	} else {
+		if((blocks = malloc(NUM_USER_BLOCKS * BLOCK_SIZE)) == NULL){
+			return -ENOMEM;
+		}
+		TRACE(image_read, vol->image, FIRST_USER_BLOCK * BLOCK_SIZE, NUM_USER_BLOCKS * BLOCK_SIZE);
+		if(pread(vol->image_fd, blocks, NUM_USER_BLOCKS * BLOCK_SIZE, FIRST_USER_BLOCK * BLOCK_SIZE) != NUM_USER_BLOCKS * BLOCK_SIZE){
+			free(blocks);
+			return -EIO;
+		}
+	}
+	memset(vol->block_crc, 0, sizeof(vol->block_crc));
+	for(int j = 0; j < NUM_USER_BLOCKS; j++){
+		vol->block_crc[FIRST_USER_BLOCK + j] = memefs_crc32c(blocks + (j * BLOCK_SIZE), BLOCK_SIZE);
+	}
+	if(vol->image_map == NULL){
+		free(blocks);
+	}
+	vol->checksums = 1;
+	vol->log_capacity = LOG_CAPACITY_CHECKSUMS;
+	return 0;
+}
+
+/**
+ * Writes the checksum table. The FAT and directory checksums are taken from
+ * what the checkpoint just wrote, the superblocks' when unmount writes them.
+ */
+static int write_checksums(volume_t *vol){
+	uint32_t table[256];
+
+	if(!vol->checksums){
+		return 0;
+	}
+	vol->block_crc[254] = vol->block_crc[239] = memefs_crc32c(vol->disk_FAT, BLOCK_SIZE);
+	for(int j = 0; j < 14; j++){
+		vol->block_crc[240 + j] = memefs_crc32c(vol->disk_directory + (j * BLOCK_SIZE), BLOCK_SIZE);
+	}
+	//User block checksums change under cache_lock as blocks are written back
+	pthread_mutex_lock(&cache_lock);
+	for(int block = 0; block < 256; block++){
+		table[block] = is_checksummed_block(block) ? htonl(vol->block_crc[block]) : 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if(vol->image_map != NULL){
+		memcpy(vol->image_map + (CHECKSUM_BLOCK * BLOCK_SIZE), table, sizeof(table));
+		return sync_map(vol, CHECKSUM_BLOCK, CHECKSUM_BLOCKS);
+	}
+	TRACE(image_write, vol->image, CHECKSUM_BLOCK * BLOCK_SIZE, sizeof(table));
+	if(pwrite(vol->image_fd, table, sizeof(table), CHECKSUM_BLOCK * BLOCK_SIZE) != sizeof(table)){
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Reads the blocks of a chain that are not cached yet, IO_MAX_RUN at a time
+ * in one batch, into unused cache slots. Prefetch never evicts.
+ */
+static void prefetch_chain(volume_t *vol, int block){
+	static uint8_t staging[IO_MAX_RUN * BLOCK_SIZE] __attribute__((aligned(4096)));
+	int wanted[IO_MAX_RUN];
+	int walked = 0;
+
+	if(vol->image_map != NULL){
+		return;
+	}
+	//Bounded walk, the chain may change under us
+	while(walked < NUM_USER_BLOCKS && is_user_block(block)){
+		io_batch_t batch = { 0, 0 };
+		io_request_t *req = NULL;
+		int count = 0;
+
+		pthread_mutex_lock(&cache_lock);
+		int room = cache_slots - cache_used;
+		while(count < room && count < IO_MAX_RUN && walked < NUM_USER_BLOCKS && is_user_block(block)){
+			if(vol->block_slot[block] < 0){
+				wanted[count++] = block;
+			}
+			block = fat_next(vol->main_FAT[block]);
+			walked++;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		if(count == 0){
+			return;
+		}
+		TRACE(prefetch, vol->image, wanted[0], count);
+
+		//Neighbouring blocks share one readv
+		for(int j = 0; j < count; j++){
+			if(req != NULL && wanted[j] != req->first_block + req->blocks){
+				io_submit(req, &batch);
+				req = NULL;
+			}
+			if(req == NULL){
+				req = io_get_request();
+				req->write = 0;
+				req->volume = vol;
+				req->first_block = wanted[j];
+			}
+			req->iov[req->blocks].iov_base = staging + (j * BLOCK_SIZE);
+			req->iov[req->blocks].iov_len = BLOCK_SIZE;
+			req->blocks++;
+		}
+		io_submit(req, &batch);
+		if(io_wait(&batch) != 0){
+			return;
+		}
+
+		pthread_mutex_lock(&cache_lock);
+		for(int j = 0; j < count; j++){
+			int slot;
+			if(vol->block_slot[wanted[j]] < 0 && block_intact(vol, wanted[j], staging + (j * BLOCK_SIZE)) &&
+			   (slot = claim_slot(vol, wanted[j], 0)) >= 0){
+				memcpy(cache_data + ((size_t) slot * BLOCK_SIZE), staging + (j * BLOCK_SIZE), BLOCK_SIZE);
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+}
+
+/**
+ * Reads ahead the chains of recently opened files until unmount
+ */
+static void *prefetch_main(void *arg){
+	(void) arg;
+
+	pthread_mutex_lock(&prefetch_lock);
+	while(prefetch_running){
+		if(prefetch_head == prefetch_tail){
+			pthread_cond_wait(&prefetch_wake, &prefetch_lock);
+			continue;
+		}
+		struct prefetch_request request = prefetch_queue[prefetch_head++ % PREFETCH_QUEUE];
+		if(request.volume == NULL){
+			continue; //its volume was unmounted
+		}
+		prefetch_current = request.volume;
+		pthread_mutex_unlock(&prefetch_lock);
+
+		volume_t *vol = request.volume;
+		prefetch_chain(vol, vol->directory_blocks[request.index].start_block);
+		pthread_mutex_lock(&prefetch_lock);
+		prefetch_current = NULL;
+		pthread_cond_broadcast(&prefetch_idle);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+	return NULL;
+}
+
+static void queue_prefetch(volume_t *vol, int index){
+	if(!options.prefetch || vol->image_map != NULL){
+		return;
+	}
+	pthread_mutex_lock(&prefetch_lock);
+	if(prefetch_running){
+		if(prefetch_tail - prefetch_head == PREFETCH_QUEUE){
+			prefetch_head++; //forget the oldest request
+		}
+		prefetch_queue[prefetch_tail % PREFETCH_QUEUE].volume = vol;
+		prefetch_queue[prefetch_tail++ % PREFETCH_QUEUE].index = index;
+		pthread_cond_signal(&prefetch_wake);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/**
+ * Drops the queued requests of a volume and waits until its chain is no longer being read
+ */
+static void forget_prefetch(volume_t *vol){
+	pthread_mutex_lock(&prefetch_lock);
+	for(unsigned j = prefetch_head; j != prefetch_tail; j++){
+		if(prefetch_queue[j % PREFETCH_QUEUE].volume == vol){
+			prefetch_queue[j % PREFETCH_QUEUE].volume = NULL;
+		}
+	}
+	while(prefetch_current == vol){
+		pthread_cond_wait(&prefetch_idle, &prefetch_lock);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+static void stop_prefetch(){
+	pthread_mutex_lock(&prefetch_lock);
+	int running = prefetch_running;
+	prefetch_running = 0;
+	pthread_cond_signal(&prefetch_wake);
+	pthread_mutex_unlock(&prefetch_lock);
+	if(running){
+		pthread_join(prefetch_thread, NULL);
+	}
+}
+
+static size_t put_log_record(volume_t *vol, uint8_t *out, uint8_t type, uint16_t index, const void *payload, uint8_t length){
+	memefs_log_record_t record;
+	record.type = type;
+	record.length = length;
+	record.index = htons(index);
+	record.generation = htonl(vol->log_generation);
+	memcpy(out, &record, sizeof(record));
+	memcpy(out + sizeof(record), payload, length);
+	return sizeof(record) + length;
+}
+
+/**
+ * Writes dirty user blocks in place, neighbouring blocks merged into one write
+ * and all writes submitted as one batch.
+ * Blocks written back by the cache since the last commit count as written.
+ */
+static int flush_user_blocks(volume_t *vol){
+	int block = FIRST_USER_BLOCK;
+	int written = 0;
+
+	if(vol->image_map != NULL){
+		//Data was written in place, only the dirty runs need to reach the disk
+		while(block < FIRST_USER_BLOCK + NUM_USER_BLOCKS){
+			int end = block;
+			while(end < FIRST_USER_BLOCK + NUM_USER_BLOCKS && vol->block_dirty[end]){
+				end++;
+			}
+			if(end > block){
+				for(int dirty = block; dirty < end; dirty++){
+					checksum_block(vol, dirty, vol->image_map + (dirty * BLOCK_SIZE));
+				}
+				if(sync_map(vol, block, end - block) != 0){
+					return -EIO;
+				}
+				memset(&vol->block_dirty[block], 0, end - block);
+				written++;
+			}
+			block = end + 1;
+		}
+		return written;
+	}
+
+	//Background writes finish first so no block is written twice at once,
+	//a failed one left its blocks dirty and is retried here
+	io_batch_t batch = { 0, 0 };
+	io_wait(&vol->writeback_batch);
+	written += submit_dirty_runs(vol, &batch);
+	int error = io_wait(&batch);
+
+	//Blocks the cache is evicting were skipped as busy, they must be on disk too
+	pthread_mutex_lock(&cache_lock);
+	while(vol->evicting > 0){
+		pthread_cond_wait(&cache_evicted, &cache_lock);
+	}
+	for(int dirty = FIRST_USER_BLOCK; dirty < FIRST_USER_BLOCK + NUM_USER_BLOCKS; dirty++){
+		if(vol->block_dirty[dirty]){
+			error = -EIO;
+		}
+	}
+	written += vol->cache_unsynced;
+	if(error == 0){
+		vol->cache_unsynced = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return error ? error : written;
+}
+
+static int load_log_header(volume_t *vol, int file_des){
+	memefs_log_header_t header;
+
+	vol->log_generation = 0;
+	vol->log_tail = 0;
+	if(pread(file_des, &header, sizeof(header), LOG_HEADER_BLOCK * BLOCK_SIZE) != sizeof(header)){
+		return -EIO;
+	}
+	if(memcmp(header.magic, "MEMELOG\0", 8) != 0){
+		return -ENOENT;
+	}
+	vol->log_generation = ntohl(header.generation);
+	return 0;
+}
+
+/**
+ * Starts a new log generation, which invalidates every record already in the log
+ */
+static int reset_log(volume_t *vol){
+	memefs_log_header_t header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "MEMELOG\0", 8);
+	header.generation = htonl(++vol->log_generation);
+	TRACE(image_write, vol->image, LOG_HEADER_BLOCK * BLOCK_SIZE, sizeof(header));
+	if(pwrite(vol->image_fd, &header, sizeof(header), LOG_HEADER_BLOCK * BLOCK_SIZE) != sizeof(header)){
+		return -EIO;
+	}
+	if(fdatasync(vol->image_fd)){
+		return -errno;
+	}
+	vol->log_tail = 0;
+	return 0;
+}
+
+/**
+ * Writes the committed FAT and directory in place, then empties the log
+ */
+static int checkpoint_log(volume_t *vol){
+	if(vol->image_map != NULL){
+		//Main FAT and directory are already in place, blocks 239 - 254 go out in one msync
+		memcpy(vol->image_map + (239 * BLOCK_SIZE), vol->disk_FAT, BLOCK_SIZE);
+		int result = sync_map(vol, 239, 16);
+		if(result == 0){
+			result = write_checksums(vol);
+		}
+		return result ? result : reset_log(vol);
+	}
+	TRACE(image_write, vol->image, 239 * BLOCK_SIZE, 16 * BLOCK_SIZE);
+	if(pwrite(vol->image_fd, vol->disk_FAT, BLOCK_SIZE, 254 * BLOCK_SIZE) != BLOCK_SIZE ||
+	   pwrite(vol->image_fd, vol->disk_FAT, BLOCK_SIZE, 239 * BLOCK_SIZE) != BLOCK_SIZE ||
+	   pwrite(vol->image_fd, vol->disk_directory, 14 * BLOCK_SIZE, 240 * BLOCK_SIZE) != 14 * BLOCK_SIZE ||
+	   write_checksums(vol) != 0){
+		return -EIO;
+	}
+	if(fdatasync(vol->image_fd)){
+		return -errno;
+	}
+	return reset_log(vol);
+}
+
+/**
+ * Logs one transaction of FAT and dirent records, checkpointing first when it
+ * does not fit behind the ones already logged, then applies it to disk_FAT and
+ * disk_directory.
+ */
+static int log_transaction(volume_t *vol, uint8_t *transaction, size_t length){
+	memefs_log_record_t record;
+
+	//The log must only ever describe the metadata that is already on disk
+	if(vol->log_tail + length + sizeof(record) + 4 > vol->log_capacity){
+		int result = checkpoint_log(vol);
+		if(result){
+			return result;
+		}
+	}
+	//Stamped now as a checkpoint starts a new generation
+	for(size_t offset = 0; offset < length; offset += sizeof(record) + record.length){
+		memcpy(&record, transaction + offset, sizeof(record));
+		record.generation = htonl(vol->log_generation);
+		memcpy(transaction + offset, &record, sizeof(record));
+	}
+	uint32_t checksum = htonl(fnv1a_hash(FNV1A_SEED, transaction, length));
+	size_t total = length + put_log_record(vol, transaction + length, LOG_COMMIT, 0, &checksum, 4);
+
+	TRACE(image_write, vol->image, (LOG_FIRST_BLOCK * BLOCK_SIZE) + vol->log_tail, total);
+	if(pwrite(vol->image_fd, transaction, total, (LOG_FIRST_BLOCK * BLOCK_SIZE) + vol->log_tail) != (ssize_t) total){
+		return -EIO;
+	}
+	if(fdatasync(vol->image_fd)){
+		return -errno;
+	}
+	vol->log_tail += total;
+	apply_log_records(vol, transaction, length);
+	return 0;
+}
+
+/**
+ * Makes every change since the last commit durable, with the volume lock held
+ * (or before and after the volume is served) so no callback changes the
+ * metadata in between. Dirty data blocks are written in place first, then the
+ * FAT and directory changes are appended to the log as one transaction, or as
+ * several when they do not fit in the log at once. With checkpoint set the
+ * metadata is then also written in place. It is logged first all the same, so
+ * a crash while it is written in place replays the log to the same state.
+ */
+static int commit_memefs(volume_t *vol, int checkpoint){
+	uint8_t transaction[LOG_CAPACITY];
+	size_t length = 0;
+	size_t limit = vol->log_capacity - sizeof(memefs_log_record_t) - 4;
+	uint8_t payload[32];
+
+	TRACE(commit, vol->image, checkpoint);
+	int written = flush_user_blocks(vol);
+	if(written < 0){
+		return written;
+	}
+	if(written > 0 && fdatasync(vol->image_fd)){
+		return -errno;
+	}
+
+	for(int j = 0; j < NUM_BLOCKS + DIRECTORY_ENTRIES; j++){
+		int fat = j < NUM_BLOCKS;
+		if(fat ? !vol->fat_dirty[j] : !vol->dirent_dirty[j - NUM_BLOCKS]){
+			continue;
+		}
+		//Each part of a split commit is a transaction of its own, recovery fixes up a crash between them
+		if(length + sizeof(memefs_log_record_t) + (fat ? 2 : 32) > limit){
+			int result = log_transaction(vol, transaction, length);
+			if(result){
+				return result;
+			}
+			length = 0;
+		}
+		if(fat){
+			uint16_t value = htons(vol->main_FAT[j]);
+			memcpy(payload, &value, 2);
+			length += put_log_record(vol, transaction + length, LOG_FAT, j, payload, 2);
+		} else {
+			encode_dirent(payload, &vol->directory_blocks[j - NUM_BLOCKS]);
+			length += put_log_record(vol, transaction + length, LOG_DIRENT, j - NUM_BLOCKS, payload, 32);
+		}
+	}
+	if(length > 0){
+		int result = log_transaction(vol, transaction, length);
+		if(result){
+			return result;
+		}
+	}
+
+	if(checkpoint){
+		return checkpoint_log(vol);
+	}
+	return 0;
+}
+
+/**
+ * Copies the records of a committed transaction to disk_FAT and disk_directory,
+ * their entries are clean from then on
+ */
+static void apply_log_records(volume_t *vol, const uint8_t *log, size_t length){
+	size_t offset = 0;
+	memefs_log_record_t record;
+
+	while(offset < length){
+		memcpy(&record, log + offset, sizeof(record));
+		const uint8_t *payload = log + offset + sizeof(record);
+		uint16_t index = ntohs(record.index);
+		if(record.type == LOG_FAT){
+			memcpy(vol->disk_FAT + (index * 2), payload, 2);
+			vol->fat_dirty[index] = 0;
+		} else if(record.type == LOG_DIRENT){
+			memcpy(vol->disk_directory + (index * sizeof(memefs_directory_t)), payload, 32);
+			vol->dirent_dirty[index] = 0;
+		}
+		offset += sizeof(record) + record.length;
+	}
+}
+
+/**
+ * Applies every committed transaction of the current log generation to
+ * disk_FAT and disk_directory. Stops at the first torn or stale record.
+ */
+static int replay_log(volume_t *vol, int file_des){
+	static uint8_t log[LOG_CAPACITY];
+	memefs_log_record_t record;
+	size_t offset = 0;
+	size_t transaction_start = 0;
+	int records = 0;
+	int applied = 0;
+
+	if(load_log_header(vol, file_des) != 0){
+		return 0;
+	}
+	if(pread(file_des, log, vol->log_capacity, LOG_FIRST_BLOCK * BLOCK_SIZE) != (ssize_t) vol->log_capacity){
+		return 0;
+	}
 
-static void reverse_conversion(char* full, char* original){
-	int counter = 0;
+	while(offset + sizeof(record) <= vol->log_capacity){
+		memcpy(&record, log + offset, sizeof(record));
+		uint16_t index = ntohs(record.index);
+		size_t next = offset + sizeof(record) + record.length;
 
-	for(int i = 0; full[i] != '\0'; i++){
-		original[counter++] = full[i];
+		if(ntohl(record.generation) != vol->log_generation || next > vol->log_capacity){
+			break;
+		}
+		if(record.type == LOG_FAT && record.length == 2 && index < 256){
+			records++;
+		} else if(record.type == LOG_DIRENT && record.length == 32 && index < 16 * 14){
+			records++;
+		} else if(record.type == LOG_COMMIT && record.length == 4){
+			uint32_t checksum;
+			memcpy(&checksum, log + offset + sizeof(record), 4);
+			if(ntohl(checksum) != fnv1a_hash(FNV1A_SEED, log + transaction_start, offset - transaction_start)){
+				break;
+			}
+			apply_log_records(vol, log + transaction_start, offset - transaction_start);
+			applied += records;
+			records = 0;
+			transaction_start = next;
+		} else {
+			break;
+		}
+		offset = next;
+	}
+	return applied;
+}
+
+/**
+ * Checks the FATs and directory after a crash, in one pass over the allocated blocks.
+ * The FATs are reconciled entry by entry, every chain is walked once with a
+ * visited bitmap (cut at invalid or shared links), sizes larger than their
+ * chain are clamped and allocated blocks no file reaches are freed.
+ * Every fix goes through set_fat / mark_dirent_dirty so the next commit writes it.
+ */
+static int recover_memefs(volume_t *vol){
+	uint8_t visited[256];
+	int fixes = 0;
+	struct timespec begin, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	memset(visited, 0, sizeof(visited));
+
+	//main_FAT wins unless its entry is not a valid link
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		uint16_t value = vol->main_FAT[block];
+		if(value == vol->backup_FAT[block]){
+			continue;
+		}
+		if(!fat_valid(value)){
+			value = vol->backup_FAT[block];
+			if(!fat_valid(value)){
+				value = 0xFFFF;
+			}
+		}
+		set_fat(vol, block, value);
+		fixes++;
 	}
 
-	original[counter++] = '.';
+	for(int j = 0; j < 16 * 14; j++){
+		memefs_directory_t *entry = &vol->directory_blocks[j];
+		if(entry->type == 0){
+			continue;
+		}
+		int block = entry->start_block;
+		if(!is_user_block(block) || visited[block] || vol->main_FAT[block] == 0){
+			fprintf(stderr, "memefs: %s: recovery dropped %.11s, bad start block %d\n", vol->image, entry->filename, block);
+			entry->type = 0;
+			strcpy(entry->filename, " ");
+			mark_dirent_dirty(vol, j);
+			fixes++;
+			continue;
+		}
+
+		//Holes count towards the blocks the chain covers
+		uint32_t blocks = 1;
+		visited[block] = 1;
+		while(vol->main_FAT[block] != 0xFFFF){
+			int next = fat_next(vol->main_FAT[block]);
+			if(!is_user_block(next) || visited[next] || vol->main_FAT[next] == 0){
+				set_fat(vol, block, 0xFFFF);
+				fixes++;
+				break;
+			}
+			visited[next] = 1;
+			blocks += 1 + fat_gap(vol->main_FAT[block]);
+			block = next;
+		}
 
-	for(int i = 8; i < 11; i++){
-		original[counter++] = full[i];
+		if(entry->size > blocks * BLOCK_SIZE){
+			entry->size = blocks * BLOCK_SIZE;
+			mark_dirent_dirty(vol, j);
+			fixes++;
+		}
 	}
 
-	original[counter] = '\0';
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		if(vol->main_FAT[block] != 0 && !visited[block]){
+			set_fat(vol, block, 0);
+			fixes++;
+		}
+	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "memefs: %s: recovery fixed %d entries in %.3f ms\n", vol->image, fixes,
+		((end.tv_sec - begin.tv_sec) * 1000.0) + ((end.tv_nsec - begin.tv_nsec) / 1000000.0));
+	return fixes;
 }
 
 static uint8_t to_bcd(uint8_t num){
@@ -838,22 +2936,816 @@ void print_bcd_timestamp(const uint8_t bcd_time[8]){
        	bcd_time[4], bcd_time[5], bcd_time[6]);
 }
 
+/**
+ * Starts the threads shared by every volume
+ */
+static void start_workers(){
+	io_start_threads();
+	if(options.prefetch && options.lazy_load && !options.mmap && !options.read_only){
+		prefetch_running = pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) == 0;
+	}
+}
+
+static void *memefs_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
+	static pthread_once_t started = PTHREAD_ONCE_INIT;
+	(void) conn;
+	(void) cfg;
+
+	//Started here rather than at mount, fuse may fork into the background in between.
+	//Each volume gets an init, only the first one starts the threads
+	pthread_once(&started, start_workers);
+	return fuse_get_context()->private_data;
+}
+
+/*
+ * -o record=FILE appends every callback to an operation trace (see memefs.h)
+ * as it returns. stdio locks the stream, each record goes out in one fwrite.
+ */
+static int start_recording(const char *file){
+	memefs_trace_header_t header;
+
+	recorder = fopen(file, "wb");
+	if(recorder == NULL){
+		perror(file);
+		return -1;
+	}
+	setvbuf(recorder, NULL, _IOFBF, 64 * 1024);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, 8);
+	header.version = htonl(TRACE_VERSION);
+	if(fwrite(&header, 1, sizeof(header), recorder) != sizeof(header)){
+		perror(file);
+		fclose(recorder);
+		recorder = NULL;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &recorder_origin);
+	return 0;
+}
+
+static void stop_recording(){
+	if(recorder != NULL && fclose(recorder) != 0){
+		perror("memefs record");
+	}
+	recorder = NULL;
+}
+
+static void record_operation(int op, const char *path, uint64_t handle, int64_t offset, uint32_t size, uint32_t extra, int64_t result, uint64_t start){
+	uint8_t record[sizeof(memefs_trace_record_t) + TRACE_PATH_MAX];
+	uint64_t latency = trace_clock(&recorder_origin) - start;
+	trace_entry_t entry = {
+		.start = start,
+		.latency = latency > UINT32_MAX ? UINT32_MAX : latency,
+		.op = op,
+		.volume = current_volume()->number,
+		.handle = handle,
+		.offset = offset,
+		.size = size,
+		.extra = extra,
+		.result = result,
+		.path = (char *) path,
+	};
+
+	fwrite(record, 1, encode_trace_record(record, &entry), recorder);
+}
+
+/*
+ * Every callback but init goes through a wrapper firing <op>_entry (path)
+ * and <op>_return (path, result) probes around it and recording it with
+ * -o record, handle, offset, size and extra being its record fields.
+ * Neither costs more than a branch while it is off. The handle is taken
+ * before the call, release clears it, or after it for the opens.
+ */
+#define TRACED(type, op, code, params, handle, offset, size, extra, ...) \
+	static type traced_##op params { \
+		uint64_t start = 0; \
+		uint64_t id = 0; \
+		if(recorder != NULL){ \
+			start = trace_clock(&recorder_origin); \
+			id = handle; \
+		} \
+		TRACE(op##_entry, path); \
+		type result = memefs_##op(path, ##__VA_ARGS__); \
+		TRACE(op##_return, path, (long) result); \
+		if(recorder != NULL){ \
+			record_operation(code, path, id ? id : handle, offset, size, extra, result, start); \
+		} \
+		return result; \
+	}
+#define HANDLE(fi) ((fi) != NULL ? (uint64_t) (fi)->fh : 0)
+
+TRACED(int, getattr, TRACE_OP_GETATTR, (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, 0, stbuf, fi)
+TRACED(int, readdir, TRACE_OP_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+	HANDLE(fi), offset, 0, flags, buf, filler, offset, fi, flags)
+TRACED(int, create, TRACE_OP_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, mode, mode, fi)
+TRACED(int, unlink, TRACE_OP_UNLINK, (const char *path),
+	0, 0, 0, 0)
+TRACED(int, open, TRACE_OP_OPEN, (const char *path, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, fi->flags, fi)
+TRACED(int, read, TRACE_OP_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+	HANDLE(fi), offset, size, 0, buf, size, offset, fi)
+TRACED(int, write, TRACE_OP_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+	HANDLE(fi), offset, size, 0, buf, size, offset, fi)
+TRACED(int, flush, TRACE_OP_FLUSH, (const char *path, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, 0, fi)
+TRACED(int, release, TRACE_OP_RELEASE, (const char *path, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, 0, fi)
+TRACED(int, truncate, TRACE_OP_TRUNCATE, (const char *path, off_t size, struct fuse_file_info *fi),
+	HANDLE(fi), size, 0, 0, size, fi)
+TRACED(off_t, lseek, TRACE_OP_LSEEK, (const char *path, off_t offset, int whence, struct fuse_file_info *fi),
+	HANDLE(fi), offset, 0, whence, offset, whence, fi)
+TRACED(int, utimens, TRACE_OP_UTIMENS, (const char *path, const struct timespec tv[2], struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, 0, tv, fi)
+TRACED(int, fsync, TRACE_OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+	HANDLE(fi), 0, 0, datasync, datasync, fi)
+TRACED(int, statfs, TRACE_OP_STATFS, (const char *path, struct statvfs *stbuf),
+	0, 0, 0, 0, stbuf)
+
 static const struct fuse_operations memefs_oper = {
-	.getattr	= memefs_getattr,
-	.readdir	= memefs_readdir,
-	.create		= memefs_create,
-	.unlink		= memefs_unlink,
-	.open		= memefs_open,
-	.read		= memefs_read,
-	.write		= memefs_write,
-	.truncate	= memefs_truncate,
-        .utimens        = memefs_utimens,
+	.init		= memefs_init,
+	.getattr	= traced_getattr,
+	.readdir	= traced_readdir,
+	.create		= traced_create,
+	.unlink		= traced_unlink,
+	.open		= traced_open,
+	.read		= traced_read,
+	.write		= traced_write,
+	.flush		= traced_flush,
+	.release	= traced_release,
+	.truncate	= traced_truncate,
+	.lseek		= traced_lseek,
+        .utimens        = traced_utimens,
+	.fsync		= traced_fsync,
+	.statfs		= traced_statfs,
 };
 
+/**
+ * Adds a volume for an image, mountpoint is NULL when fuse_main mounts it.
+ * Both strings are owned by the volume from then on.
+ */
+static volume_t *add_volume(char *image, char *mountpoint){
+	void *memory = NULL;
+
+	volume_t **grown = realloc(volumes, (num_volumes + 1) * sizeof(*volumes));
+	if(grown == NULL){
+		return NULL;
+	}
+	volumes = grown;
+	if(posix_memalign(&memory, 16, sizeof(volume_t)) != 0){
+		return NULL;
+	}
+	volume_t *vol = memset(memory, 0, sizeof(volume_t));
+	vol->image = image;
+	vol->mountpoint = mountpoint;
+	vol->image_fd = -1;
+	vol->data_fd = -1;
+	pthread_mutex_init(&vol->lock, NULL);
+	vol->disk_FAT = vol->private_FAT;
+	vol->disk_directory = vol->private_directory;
+	for(int block = 0; block < 256; block++){
+		vol->block_slot[block] = -1;
+	}
+	vol->number = num_volumes;
+	volumes[num_volumes++] = vol;
+	return vol;
+}
+
+static void free_volumes(){
+	for(int j = 0; j < num_volumes; j++){
+		free(volumes[j]->image);
+		free(volumes[j]->mountpoint);
+		pthread_mutex_destroy(&volumes[j]->lock);
+		free(volumes[j]);
+	}
+	free(volumes);
+	volumes = NULL;
+	num_volumes = 0;
+}
+
+/**
+ * Takes volume=IMAGE:MOUNTPOINT options, and the image path in front of the
+ * mountpoint when a single volume is given the old way. The rest goes to fuse.
+ */
+static int memefs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs){
+	(void) data;
+	(void) outargs;
+
+	if(key == KEY_VOLUME){
+		const char *spec = arg + strlen("volume=");
+		const char *colon = strrchr(spec, ':');
+		if(colon == NULL || colon == spec || colon[1] == '\0'){
+			fprintf(stderr, "memefs: expected volume=image:mountpoint, got %s\n", arg);
+			return -1;
+		}
+		char *image = strndup(spec, colon - spec);
+		char *mountpoint = strdup(colon + 1);
+		if(image == NULL || mountpoint == NULL || add_volume(image, mountpoint) == NULL){
+			free(image);
+			free(mountpoint);
+			return -1;
+		}
+		return 0;
+	}
+	if(key == KEY_READ_ONLY){
+		options.read_only = 1;
+		return 1; //the kernel mount is made read-only too
+	}
+	if(key == FUSE_OPT_KEY_NONOPT && options.image == NULL){
+		options.image = strdup(arg);
+		return options.image == NULL ? -1 : 0;
+	}
+	return 1;
+}
+
+/**
+ * Unmounts a volume that is still being served, which ends its loop
+ */
+static void stop_serving(volume_t *vol){
+	pthread_mutex_lock(&volumes_lock);
+	if(vol->serving){
+		vol->serving = 0;
+		fuse_exit(vol->fuse);
+		fuse_unmount(vol->fuse);
+	}
+	pthread_mutex_unlock(&volumes_lock);
+}
+
+/**
+ * Hands out a request buffer of a volume, counting the request as in progress
+ */
+static pool_buffer_t *take_buffer(volume_t *vol){
+	pthread_mutex_lock(&volumes_lock);
+	pool_buffer_t *buffer = vol->spare_buffers;
+	if(buffer != NULL){
+		vol->spare_buffers = buffer->next;
+	} else {
+		//The first read allocates the memory, sized by the volume's session
+		buffer = calloc(1, sizeof(*buffer));
+	}
+	vol->requests += buffer != NULL;
+	pthread_mutex_unlock(&volumes_lock);
+	return buffer;
+}
+
+static void give_buffer(volume_t *vol, pool_buffer_t *buffer){
+	pthread_mutex_lock(&volumes_lock);
+	buffer->next = vol->spare_buffers;
+	vol->spare_buffers = buffer;
+	if(--vol->requests == 0){
+		pthread_cond_broadcast(&pool_idle);
+	}
+	pthread_mutex_unlock(&volumes_lock);
+}
+
+/**
+ * Writes back a volume whose session ended, once the requests other pool
+ * threads are still running on it are done. The last one wakes main.
+ */
+static void finish_volume(volume_t *vol){
+	stop_serving(vol);
+	epoll_ctl(pool_epoll, EPOLL_CTL_DEL, fuse_session_fd(fuse_get_session(vol->fuse)), NULL);
+	pthread_mutex_lock(&volumes_lock);
+	while(vol->requests > 0){
+		pthread_cond_wait(&pool_idle, &volumes_lock);
+	}
+	while(vol->spare_buffers != NULL){
+		pool_buffer_t *buffer = vol->spare_buffers;
+		vol->spare_buffers = buffer->next;
+		free(buffer->buf.mem);
+		free(buffer);
+	}
+	pthread_mutex_unlock(&volumes_lock);
+	unmount_memefs(vol);
+
+	pthread_mutex_lock(&volumes_lock);
+	if(--volumes_serving == 0){
+		kill(getpid(), SIGTERM);
+		pthread_cond_broadcast(&pool_idle);
+	}
+	pthread_mutex_unlock(&volumes_lock);
+}
+
+/**
+ * A thread of the pool shared by every volume: takes the next request of
+ * whichever volume has one and runs its callback. EPOLLONESHOT gives each
+ * device to one thread at a time and it is re-armed as soon as the request is
+ * read, so the next request of the same volume runs on another thread.
+ */
+static void *pool_worker(void *arg){
+	struct epoll_event event;
+	(void) arg;
+
+	while(1){
+		if(epoll_wait(pool_epoll, &event, 1, -1) != 1){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		volume_t *vol = event.data.ptr;
+		if(vol == NULL){
+			break; //the wakeup eventfd stays readable, every thread sees it
+		}
+		struct fuse_session *session = fuse_get_session(vol->fuse);
+		pool_buffer_t *buffer = take_buffer(vol);
+		int result = buffer != NULL ? fuse_session_receive_buf(session, &buffer->buf) : -ENOMEM;
+
+		//Devices are non-blocking, another thread may have taken the request
+		int more = result > 0 || result == -EAGAIN || result == -EINTR || result == -ENOMEM;
+		if(more){
+			event.events = EPOLLIN | EPOLLONESHOT;
+			epoll_ctl(pool_epoll, EPOLL_CTL_MOD, fuse_session_fd(session), &event);
+		}
+		if(result > 0){
+			fuse_session_process_buf(session, &buffer->buf);
+		}
+		if(buffer != NULL){
+			give_buffer(vol, buffer);
+		}
+		if(!more){
+			finish_volume(vol);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Puts the fuse device of every volume in one epoll set and starts the pool:
+ * max_threads threads (1 with -s) whatever the number of volumes
+ */
+static int start_pool(){
+	struct epoll_event event;
+
+	pool_epoll = epoll_create1(EPOLL_CLOEXEC);
+	pool_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(pool_epoll < 0 || pool_wakeup < 0){
+		return -errno;
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if(epoll_ctl(pool_epoll, EPOLL_CTL_ADD, pool_wakeup, &event) != 0){
+		return -errno;
+	}
+	for(int j = 0; j < num_volumes; j++){
+		int fd = fuse_session_fd(fuse_get_session(volumes[j]->fuse));
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = volumes[j];
+		if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 || epoll_ctl(pool_epoll, EPOLL_CTL_ADD, fd, &event) != 0){
+			return -errno;
+		}
+	}
+
+	//Since 3.12 max_idle_threads defaults to UINT_MAX and max_threads is the pool size
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+	unsigned int requested = serve_options.max_threads;
+#else
+	unsigned int requested = serve_options.max_idle_threads;
+#endif
+	int size = POOL_THREADS;
+	if(serve_options.singlethread){
+		size = 1;
+	}else if(requested > POOL_MAX_THREADS && requested != UINT_MAX){
+		fprintf(stderr, "memefs: max_threads %u is too large, using %d\n", requested, POOL_MAX_THREADS);
+		size = POOL_MAX_THREADS;
+	}else if(requested > 0 && requested != UINT_MAX){
+		size = requested;
+	}
+	pool_threads = calloc(size, sizeof(*pool_threads));
+	if(pool_threads == NULL){
+		return -ENOMEM;
+	}
+	for(pool_size = 0; pool_size < size; pool_size++){
+		if(pthread_create(&pool_threads[pool_size], NULL, pool_worker, NULL) != 0){
+			break;
+		}
+	}
+	return pool_size > 0 ? 0 : -EAGAIN;
+}
+
+/**
+ * Stops the pool once every volume has been written back
+ */
+static void stop_pool(){
+	pthread_mutex_lock(&volumes_lock);
+	while(volumes_serving > 0 && pool_size > 0){
+		pthread_cond_wait(&pool_idle, &volumes_lock);
+	}
+	pthread_mutex_unlock(&volumes_lock);
+	if(pool_wakeup >= 0){
+		eventfd_write(pool_wakeup, 1);
+	}
+	for(int j = 0; j < pool_size; j++){
+		pthread_join(pool_threads[j], NULL);
+	}
+	free(pool_threads);
+	pool_threads = NULL;
+	pool_size = 0;
+	if(pool_epoll >= 0){
+		close(pool_epoll);
+	}
+	if(pool_wakeup >= 0){
+		close(pool_wakeup);
+	}
+	pool_epoll = pool_wakeup = -1;
+}
+
+/**
+ * Mounts every volume with its own fuse instance and serves them all from one
+ * worker pool, until a signal arrives or every volume has been unmounted
+ */
+static int serve_volumes(struct fuse_args *args){
+	sigset_t signals;
+	int mounted;
+	int received;
+
+	if(fuse_parse_cmdline(args, &serve_options) != 0){
+		return 1;
+	}
+	if(serve_options.mountpoint != NULL){
+		fprintf(stderr, "memefs: with volume= options every mountpoint is given in its option\n");
+		free(serve_options.mountpoint);
+		return 1;
+	}
+
+	for(mounted = 0; mounted < num_volumes; mounted++){
+		volume_t *vol = volumes[mounted];
+		if(mount_memefs(vol) != 0){
+			fprintf(stderr, "memefs: cannot mount %s\n", vol->image);
+			break;
+		}
+		//fuse_new consumes the arguments, each volume parses its own copy
+		struct fuse_args copy = FUSE_ARGS_INIT(0, NULL);
+		for(int j = 0; j < args->argc; j++){
+			fuse_opt_add_arg(&copy, args->argv[j]);
+		}
+		vol->fuse = fuse_new(&copy, &memefs_oper, sizeof(memefs_oper), vol);
+		fuse_opt_free_args(&copy);
+		if(vol->fuse == NULL || fuse_mount(vol->fuse, vol->mountpoint) != 0){
+			fprintf(stderr, "memefs: cannot mount %s on %s\n", vol->image, vol->mountpoint);
+			if(vol->fuse != NULL){
+				fuse_destroy(vol->fuse);
+				vol->fuse = NULL;
+			}
+			unmount_memefs(vol);
+			break;
+		}
+	}
+	if(mounted < num_volumes || fuse_daemonize(serve_options.foreground) != 0){
+		for(int j = 0; j < mounted; j++){
+			fuse_unmount(volumes[j]->fuse);
+			fuse_destroy(volumes[j]->fuse);
+			unmount_memefs(volumes[j]);
+		}
+		return 1;
+	}
+
+	//Only main takes the signals, the pool threads inherit the mask
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	volumes_serving = num_volumes;
+	for(int j = 0; j < num_volumes; j++){
+		volumes[j]->serving = 1;
+	}
+	int error = start_pool();
+	if(error != 0){
+		fprintf(stderr, "memefs: cannot start the worker pool: %s\n", strerror(-error));
+		for(int j = 0; j < num_volumes; j++){
+			stop_serving(volumes[j]);
+		}
+		stop_pool();
+		for(int j = 0; j < num_volumes; j++){
+			unmount_memefs(volumes[j]);
+			fuse_destroy(volumes[j]->fuse);
+		}
+		return 1;
+	}
+	sigwait(&signals, &received);
+
+	for(int j = 0; j < num_volumes; j++){
+		stop_serving(volumes[j]);
+	}
+	stop_pool();
+	for(int j = 0; j < num_volumes; j++){
+		fuse_destroy(volumes[j]->fuse);
+	}
+	stop_prefetch();
+	return 0;
+}
+
+/*
+ * In-process replay (-o replay=FILE): the callbacks of a trace are called
+ * directly on the volumes, one at a time in the order they started, as fast
+ * as they go or at the recorded pace with replay_timed. Nothing goes through
+ * fuse or the kernel, the latency measured is the filesystem's own.
+ * replay_crash ends the process after the last operation as if it had been
+ * killed, leaving the image as a crash would for the next mount to recover.
+ */
+typedef struct replay_handle {
+	uint64_t id;               // handle in the trace
+	volume_t *volume;
+	struct fuse_file_info fi;  // handle it stands for in this replay
+} replay_handle_t;
+
+typedef struct replay {
+	replay_handle_t *handles;
+	int open;
+	int capacity;
+	char *buffer;              // data for reads and writes, as large as the largest
+} replay_t;
+
+static struct fuse_file_info *find_replay_handle(replay_t *replay, uint64_t id){
+	for(int j = replay->open - 1; j >= 0; j--){
+		if(replay->handles[j].id == id){
+			return &replay->handles[j].fi;
+		}
+	}
+	return NULL;
+}
+
+static struct fuse_file_info *add_replay_handle(replay_t *replay, uint64_t id, const struct fuse_file_info *fi){
+	if(replay->open == replay->capacity){
+		int capacity = replay->capacity ? replay->capacity * 2 : 64;
+		replay_handle_t *grown = realloc(replay->handles, capacity * sizeof(*grown));
+		if(grown == NULL){
+			return NULL;
+		}
+		replay->handles = grown;
+		replay->capacity = capacity;
+	}
+	replay->handles[replay->open].id = id;
+	replay->handles[replay->open].volume = replay_volume;
+	replay->handles[replay->open].fi = *fi;
+	return &replay->handles[replay->open++].fi;
+}
+
+static void drop_replay_handle(replay_t *replay, uint64_t id){
+	for(int j = 0; j < replay->open; j++){
+		if(replay->handles[j].id == id){
+			replay->handles[j] = replay->handles[--replay->open];
+			return;
+		}
+	}
+}
+
+// Files opened before recording started are opened on first use, untimed
+static struct fuse_file_info *replay_handle(replay_t *replay, const trace_entry_t *entry){
+	struct fuse_file_info *fi = find_replay_handle(replay, entry->handle);
+	struct fuse_file_info opened;
+
+	if(fi != NULL || entry->op == TRACE_OP_RELEASE){
+		return fi;
+	}
+	memset(&opened, 0, sizeof(opened));
+	opened.flags = options.read_only ? O_RDONLY : O_RDWR;
+	if(memefs_open(entry->path, &opened) != 0){
+		return NULL;
+	}
+	return add_replay_handle(replay, entry->handle, &opened);
+}
+
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t offset, enum fuse_fill_dir_flags flags){
+	(void) buf;
+	(void) name;
+	(void) stbuf;
+	(void) offset;
+	(void) flags;
+	return 0;
+}
+
+/**
+ * Calls the callback of one trace entry and returns how long it took,
+ * UINT64_MAX when it could not be replayed
+ */
+static uint64_t replay_entry(replay_t *replay, const trace_entry_t *entry, int64_t *result){
+	const char *path = entry->path;
+	struct fuse_file_info *fi = NULL;
+	struct fuse_file_info opened;
+	struct timespec begin;
+	struct stat st;
+	struct statvfs stv;
+
+	switch(entry->op){
+	case TRACE_OP_READ:
+	case TRACE_OP_WRITE:
+	case TRACE_OP_FLUSH:
+	case TRACE_OP_RELEASE:
+	case TRACE_OP_LSEEK:
+	case TRACE_OP_FSYNC:
+		fi = replay_handle(replay, entry);
+		if(fi == NULL){
+			return UINT64_MAX;
+		}
+		break;
+	case TRACE_OP_GETATTR:
+	case TRACE_OP_TRUNCATE:
+	case TRACE_OP_UTIMENS:
+		//The handle is optional for these
+		if(entry->handle != 0){
+			fi = find_replay_handle(replay, entry->handle);
+		}
+		break;
+	}
+	memset(&opened, 0, sizeof(opened));
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	switch(entry->op){
+	case TRACE_OP_GETATTR:
+		*result = memefs_getattr(path, &st, fi);
+		break;
+	case TRACE_OP_READDIR:
+		*result = memefs_readdir(path, NULL, replay_filler, entry->offset, NULL, entry->extra);
+		break;
+	case TRACE_OP_CREATE:
+		opened.flags = O_CREAT | O_RDWR;
+		*result = memefs_create(path, entry->extra, &opened);
+		break;
+	case TRACE_OP_UNLINK:
+		*result = memefs_unlink(path);
+		break;
+	case TRACE_OP_OPEN:
+		opened.flags = entry->extra;
+		*result = memefs_open(path, &opened);
+		break;
+	case TRACE_OP_READ:
+		*result = memefs_read(path, replay->buffer, entry->size, entry->offset, fi);
+		break;
+	case TRACE_OP_WRITE:
+		*result = memefs_write(path, replay->buffer, entry->size, entry->offset, fi);
+		break;
+	case TRACE_OP_FLUSH:
+		*result = memefs_flush(path, fi);
+		break;
+	case TRACE_OP_RELEASE:
+		*result = memefs_release(path, fi);
+		break;
+	case TRACE_OP_TRUNCATE:
+		*result = memefs_truncate(path, entry->offset, fi);
+		break;
+	case TRACE_OP_LSEEK:
+		*result = memefs_lseek(path, entry->offset, entry->extra, fi);
+		break;
+	case TRACE_OP_UTIMENS:
+		*result = memefs_utimens(path, NULL, fi);
+		break;
+	case TRACE_OP_FSYNC:
+		*result = memefs_fsync(path, entry->extra, fi);
+		break;
+	case TRACE_OP_STATFS:
+		*result = memefs_statfs(path, &stv);
+		break;
+	default:
+		return UINT64_MAX;
+	}
+	uint64_t latency = trace_clock(&begin);
+
+	if((entry->op == TRACE_OP_CREATE || entry->op == TRACE_OP_OPEN) && *result == 0){
+		add_replay_handle(replay, entry->handle, &opened);
+	} else if(entry->op == TRACE_OP_RELEASE){
+		drop_replay_handle(replay, entry->handle);
+	}
+	return latency;
+}
+
+static int replay_trace(const char *file){
+	replay_t replay = { 0 };
+	struct timespec origin;
+	uint32_t largest = 1;
+	size_t count;
+	int mounted;
+
+	trace_entry_t *entries = load_trace(file, &count);
+	if(entries == NULL){
+		return 1;
+	}
+	for(size_t i = 0; i < count; i++){
+		if(entries[i].size > largest){
+			largest = entries[i].size;
+		}
+	}
+	uint64_t *latency = malloc((count + 1) * sizeof(*latency));
+	int64_t *result = calloc(count + 1, sizeof(*result));
+	replay.buffer = malloc(largest);
+	if(latency == NULL || result == NULL || replay.buffer == NULL){
+		perror("memefs replay");
+		free(latency);
+		free(result);
+		free(replay.buffer);
+		free_trace(entries, count);
+		return 1;
+	}
+	memset(replay.buffer, 'M', largest);
+
+	for(mounted = 0; mounted < num_volumes; mounted++){
+		if(mount_memefs(volumes[mounted]) != 0){
+			fprintf(stderr, "memefs: cannot mount %s\n", volumes[mounted]->image);
+			break;
+		}
+	}
+	if(mounted == num_volumes){
+		start_workers();
+		clock_gettime(CLOCK_MONOTONIC, &origin);
+		for(size_t i = 0; i < count; i++){
+			if(options.replay_timed){
+				trace_wait(&origin, entries[i].start - entries[0].start);
+			}
+			//Entries of volumes this replay does not have go to the first one
+			replay_volume = volumes[entries[i].volume < num_volumes ? entries[i].volume : 0];
+			latency[i] = replay_entry(&replay, &entries[i], &result[i]);
+		}
+		uint64_t elapsed = trace_clock(&origin);
+
+		if(options.replay_crash){
+			//Nothing after the last fsync is written back, no file is released
+			report_replay(entries, latency, result, count, elapsed);
+			fflush(stdout);
+			_exit(0);
+		}
+		//Files the trace left open are closed so their writes reach the image
+		for(int j = 0; j < replay.open; j++){
+			replay_volume = replay.handles[j].volume;
+			memefs_release("", &replay.handles[j].fi);
+		}
+		replay_volume = NULL;
+		stop_prefetch();
+		report_replay(entries, latency, result, count, elapsed);
+	}
+	for(int j = 0; j < mounted; j++){
+		unmount_memefs(volumes[j]);
+	}
+
+	free(replay.handles);
+	free(replay.buffer);
+	free(latency);
+	free(result);
+	free_trace(entries, count);
+	return mounted == num_volumes ? 0 : 1;
+}
+
+static void usage(const char *program){
+	printf("Usage: %s image mountpoint [options]\n"
+	       "       %s -o volume=image:mountpoint[,volume=...] [options]\n"
+	       "       %s image -o replay=trace[,replay_timed][,replay_crash] [options]\n", program, program, program);
+}
+
 int main(int argc, char *argv[]){
-	mount_memefs();
-	int result = fuse_main(--argc, ++argv, &memefs_oper, NULL);
-	unmount_memefs();
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int result = 1;
+
+	if(fuse_opt_parse(&args, &options, option_spec, memefs_opt_proc) == -1){
+		goto out;
+	}
+	if(options.image != NULL){
+		if(num_volumes > 0){
+			fprintf(stderr, "memefs: give either an image and a mountpoint or volume= options\n");
+			goto out;
+		}
+		if(add_volume(options.image, NULL) == NULL){
+			goto out;
+		}
+		options.image = NULL;
+	}
+	if(num_volumes == 0){
+		usage(argv[0]);
+		goto out;
+	}
+	if(options.record != NULL && start_recording(options.record) != 0){
+		goto out;
+	}
+
+	if(!options.mmap && !options.read_only){
+		io_setup();
+	}
+	if(init_cache() != 0){
+		perror("memefs cache");
+		io_teardown();
+		goto out;
+	}
+	if(options.replay != NULL){
+		result = replay_trace(options.replay);
+	} else if(volumes[0]->mountpoint == NULL){
+		volume_t *vol = volumes[0];
+		if(mount_memefs(vol) == 0){
+			result = fuse_main(args.argc, args.argv, &memefs_oper, vol);
+			stop_prefetch();
+			unmount_memefs(vol);
+		}
+	} else {
+		result = serve_volumes(&args);
+	}
+	free_cache();
+	io_teardown();
+out:
+	stop_recording();
+	free(options.image);
+	free(options.record);
+	free(options.replay);
+	free_volumes();
+	fuse_opt_free_args(&args);
 	return result;
 }
-
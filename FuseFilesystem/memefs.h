@@ -0,0 +1,580 @@
+/*
+    memefs.h
+
+    On-disk structures of the MEMEfs image, shared by memefs.c, mkmemefs.c
+    and the image tools, and the dump and trace formats. Everything on disk
+    is big-endian.
+
+    Image layout (256 blocks of 512 bytes):
+        0           backup superblock
+        1 - 18      reserved blocks (intent log, the checksum table in
+                    17 - 18 when the image has checksums)
+        19 - 238    user data blocks
+        239         backup FAT
+        240 - 253   directory (14 blocks, 16 entries each)
+        254         main FAT
+        255         main superblock
+*/
+
+#ifndef MEMEFS_H
+#define MEMEFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+// The SIMD codec below byte swaps, which is only right on little-endian hosts
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <immintrin.h>
+#define MEMEFS_SIMD 1
+#else
+#define MEMEFS_SIMD 0
+#endif
+
+// FNV-1a, for the intent log commit records and the dump stream checksum
+#define FNV1A_SEED 2166136261u
+
+static inline uint32_t fnv1a_hash(uint32_t hash, const void *data, size_t length){
+	const uint8_t *bytes = data;
+	for(size_t i = 0; i < length; i++){
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+#define BLOCK_SIZE 512
+#define NUM_BLOCKS 256
+
+#define BACKUP_SUPERBLOCK_BLOCK 0
+#define MAIN_SUPERBLOCK_BLOCK 255
+#define MAIN_FAT_BLOCK 254
+#define BACKUP_FAT_BLOCK 239
+#define DIRECTORY_START_BLOCK 240
+#define DIRECTORY_BLOCKS 14
+#define DIRECTORY_ENTRIES (16 * DIRECTORY_BLOCKS)
+#define FIRST_USER_BLOCK 19
+#define NUM_USER_BLOCKS 220
+
+// FAT values
+#define FAT_FREE 0x0000
+#define FAT_END 0xFFFF
+
+// A link may skip a hole in a sparse file: the low byte is the next block and
+// the high byte how many blocks of the file before it are not allocated.
+// Dense chains have no high byte, so they read the same as before.
+#define FAT_MAX_GAP 0xFF
+
+#define MEMEFS_SIGNATURE "?MEMEFS+CMSC421"
+
+// Values of cleanly_unmounted
+#define MEMEFS_CLEAN 0x00
+#define MEMEFS_DIRTY 0xFF
+
+/*
+ * Intent log kept in the reserved blocks (1 - 18).
+ * Block 1 holds the header, records are appended from block 2 onwards.
+ * Every record is stored big-endian like the rest of the image.
+ */
+#define LOG_HEADER_BLOCK 1
+#define LOG_FIRST_BLOCK 2
+#define LOG_CAPACITY (17 * BLOCK_SIZE)
+#define LOG_FAT 1
+#define LOG_DIRENT 2
+#define LOG_COMMIT 3
+
+/*
+ * Optional checksum table, on when MEMEFS_CHECKSUMS is set in the superblock
+ * features: a big-endian CRC32C of every block in blocks 17 - 18, taken from
+ * the end of the intent log. Entries of the log blocks and of the table
+ * itself are not used.
+ */
+#define MEMEFS_CHECKSUMS 0x01
+#define CHECKSUM_BLOCK 17
+#define CHECKSUM_BLOCKS 2
+#define LOG_CAPACITY_CHECKSUMS (15 * BLOCK_SIZE)
+
+// Structure representing the superblock metadata for the filesystem.
+typedef struct memefs_superblock {
+	char signature[16];        // Filesystem signature
+	uint8_t cleanly_unmounted; // Flag for unmounted state
+	uint8_t features;          // MEMEFS_CHECKSUMS
+	uint8_t reserved_bytes[2];     // Reserved bytes
+	uint32_t fs_version;       // Filesystem version
+	uint8_t fs_ctime[8];       // Creation timestamp in BCD format
+	uint16_t main_fat;         // Starting block for main FAT
+	uint16_t main_fat_size;    // Size of the main FAT
+	uint16_t backup_fat;       // Starting block for backup FAT
+	uint16_t backup_fat_size;  // Size of the backup FAT
+	uint16_t directory_start;  // Starting block for directory
+	uint16_t directory_size;   // Directory size in blocks
+	uint16_t num_user_blocks;  // Number of user data blocks
+	uint16_t first_user_block; // First user data block
+	char volume_label[16];     // Volume label
+	uint8_t unused[448];       // Unused space for alignment
+} __attribute__((packed)) memefs_superblock_t;
+
+// One 32 byte directory entry.
+typedef struct directory_block {
+	uint16_t type;
+	uint16_t start_block;
+	char filename[11];
+	uint8_t unused;
+	uint8_t timestamp[8];
+	uint32_t size;
+	uint16_t ownerUID;
+	uint16_t groupGID;
+} __attribute__((packed)) memefs_directory_t;
+
+typedef struct memefs_log_header {
+	char magic[8];             // "MEMELOG\0"
+	uint32_t generation;       // Records from other generations are stale
+	uint8_t unused[500];
+} __attribute__((packed)) memefs_log_header_t;
+
+typedef struct memefs_log_record {
+	uint8_t type;              // LOG_FAT, LOG_DIRENT or LOG_COMMIT
+	uint8_t length;            // Payload bytes following the record
+	uint16_t index;            // FAT entry or directory slot
+	uint32_t generation;       // Must match the header generation
+} __attribute__((packed)) memefs_log_record_t;
+
+/*
+ * Stream written by memefs-dump and read back by memefs-restore. The header
+ * is followed, deflated with zlib when DUMP_COMPRESSED is set, by the main
+ * and backup superblock, the main FAT and the directory blocks exactly as on
+ * disk, then one record per allocated user block (a 2 byte block number and
+ * the block), files first in directory and chain order. A 4 byte FNV-1a
+ * checksum of everything after the header ends the stream.
+ */
+#define DUMP_MAGIC "MEMEDUMP"
+#define DUMP_VERSION 1
+#define DUMP_COMPRESSED 0x1
+
+typedef struct memefs_dump_header {
+	char magic[8];             // DUMP_MAGIC, not terminated
+	uint32_t version;
+	uint32_t flags;
+	uint16_t blocks;           // user block records in the stream
+	uint8_t unused[14];
+} __attribute__((packed)) memefs_dump_header_t;
+
+/*
+ * Operation trace written by memefs -o record=FILE and replayed by
+ * memefs -o replay=FILE in-process or by memefs-replay through a mount.
+ * The header is followed by one record per callback in the order they
+ * returned, each followed by path_length bytes of its path.
+ */
+#define TRACE_MAGIC "MEMETRCE"
+#define TRACE_VERSION 1
+#define TRACE_PATH_MAX 255
+
+// Callbacks in a trace
+#define TRACE_OP_GETATTR 0
+#define TRACE_OP_READDIR 1
+#define TRACE_OP_CREATE 2
+#define TRACE_OP_UNLINK 3
+#define TRACE_OP_OPEN 4
+#define TRACE_OP_READ 5
+#define TRACE_OP_WRITE 6
+#define TRACE_OP_FLUSH 7
+#define TRACE_OP_RELEASE 8
+#define TRACE_OP_TRUNCATE 9
+#define TRACE_OP_LSEEK 10
+#define TRACE_OP_UTIMENS 11
+#define TRACE_OP_FSYNC 12
+#define TRACE_OP_STATFS 13
+#define TRACE_OPS 14
+
+typedef struct memefs_trace_header {
+	char magic[8];             // TRACE_MAGIC, not terminated
+	uint32_t version;
+	uint8_t unused[20];
+} __attribute__((packed)) memefs_trace_header_t;
+
+typedef struct memefs_trace_record {
+	uint64_t start;            // ns since recording began
+	uint32_t latency;          // ns spent in the callback, saturated
+	uint8_t op;                // TRACE_OP_*
+	uint8_t path_length;       // path bytes following the record
+	uint16_t volume;           // volume= position of the image, 0 for a single one
+	uint64_t handle;           // identifies the open file, 0 without one
+	int64_t offset;            // read, write, readdir and lseek offset, truncate size
+	uint32_t size;             // read and write size
+	uint32_t extra;            // create mode, open flags, readdir flags, whence or datasync
+	int64_t result;
+} __attribute__((packed)) memefs_trace_record_t;
+
+// A trace record in host byte order, with its path.
+typedef struct trace_entry {
+	uint64_t start;
+	uint32_t latency;
+	uint8_t op;
+	uint16_t volume;
+	uint64_t handle;
+	int64_t offset;
+	uint32_t size;
+	uint32_t extra;
+	int64_t result;
+	char *path;
+} trace_entry_t;
+
+// Encodes a record and its path, returns the bytes written to out.
+static inline size_t encode_trace_record(uint8_t *out, const trace_entry_t *entry){
+	memefs_trace_record_t record;
+	size_t length = strlen(entry->path);
+
+	if(length > TRACE_PATH_MAX){
+		length = TRACE_PATH_MAX;
+	}
+	record.start = htobe64(entry->start);
+	record.latency = htonl(entry->latency);
+	record.op = entry->op;
+	record.path_length = length;
+	record.volume = htons(entry->volume);
+	record.handle = htobe64(entry->handle);
+	record.offset = htobe64(entry->offset);
+	record.size = htonl(entry->size);
+	record.extra = htonl(entry->extra);
+	record.result = htobe64(entry->result);
+	memcpy(out, &record, sizeof(record));
+	memcpy(out + sizeof(record), entry->path, length);
+	return sizeof(record) + length;
+}
+
+// Decodes a record, the path is left to the caller.
+static inline void decode_trace_record(trace_entry_t *entry, const memefs_trace_record_t *record){
+	entry->start = be64toh(record->start);
+	entry->latency = ntohl(record->latency);
+	entry->op = record->op;
+	entry->volume = ntohs(record->volume);
+	entry->handle = be64toh(record->handle);
+	entry->offset = be64toh(record->offset);
+	entry->size = ntohl(record->size);
+	entry->extra = ntohl(record->extra);
+	entry->result = be64toh(record->result);
+	entry->path = NULL;
+}
+
+// CRC32C (Castagnoli, reflected 0x82F63B78) of every byte value.
+static const uint32_t memefs_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static inline uint32_t memefs_crc32c_bytes(uint32_t crc, const uint8_t *data, size_t length){
+	for(size_t i = 0; i < length; i++){
+		crc = memefs_crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if MEMEFS_SIMD && defined(__x86_64__)
+// SSE4.2 has the CRC32C step as an instruction, 8 bytes at a time.
+__attribute__((target("sse4.2")))
+static inline uint32_t memefs_crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length){
+	uint64_t value = crc;
+	size_t i = 0;
+
+	for(; i + 8 <= length; i += 8){
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		value = _mm_crc32_u64(value, word);
+	}
+	crc = (uint32_t) value;
+	for(; i < length; i++){
+		crc = _mm_crc32_u8(crc, data[i]);
+	}
+	return crc;
+}
+#endif
+
+// CRC32C of a buffer, with SSE4.2 when the CPU has it (checked at run time).
+static inline uint32_t memefs_crc32c(const void *data, size_t length){
+#if MEMEFS_SIMD && defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")){
+		return ~memefs_crc32c_sse42(~0u, data, length);
+	}
+#endif
+	return ~memefs_crc32c_bytes(~0u, data, length);
+}
+
+static inline int is_user_block(int block){
+	return block >= FIRST_USER_BLOCK && block < FIRST_USER_BLOCK + NUM_USER_BLOCKS;
+}
+
+static inline int fat_next(uint16_t value){
+	return value == FAT_END ? FAT_END : value & 0xFF;
+}
+
+static inline int fat_gap(uint16_t value){
+	return value == FAT_END ? 0 : value >> 8;
+}
+
+static inline uint16_t fat_link(int gap, int next){
+	return (uint16_t) ((gap << 8) | next);
+}
+
+// A FAT value is free, the end of a chain or a link to a user block.
+static inline int fat_valid(uint16_t value){
+	return value == FAT_FREE || value == FAT_END || is_user_block(fat_next(value));
+}
+
+// Blocks the checksum table covers: superblocks, user blocks, FATs and directory.
+static inline int is_checksummed_block(int block){
+	return block == BACKUP_SUPERBLOCK_BLOCK || block >= FIRST_USER_BLOCK;
+}
+
+// Reads the checksum of a block from the table of an image held in memory.
+static inline uint32_t image_checksum(const uint8_t *image, int block){
+	uint32_t crc;
+	memcpy(&crc, image + (CHECKSUM_BLOCK * BLOCK_SIZE) + (block * 4), 4);
+	return ntohl(crc);
+}
+
+// Fills the checksum table of an image held in memory from its blocks.
+static inline void build_checksums(uint8_t *image){
+	memset(image + (CHECKSUM_BLOCK * BLOCK_SIZE), 0, CHECKSUM_BLOCKS * BLOCK_SIZE);
+	for(int block = 0; block < NUM_BLOCKS; block++){
+		if(is_checksummed_block(block)){
+			uint32_t crc = htonl(memefs_crc32c(image + (block * BLOCK_SIZE), BLOCK_SIZE));
+			memcpy(image + (CHECKSUM_BLOCK * BLOCK_SIZE) + (block * 4), &crc, 4);
+		}
+	}
+}
+
+// Converts an on-disk superblock to host byte order.
+static inline void decode_superblock(memefs_superblock_t *sb, const uint8_t *in){
+	memcpy(sb, in, sizeof(*sb));
+	sb->fs_version = ntohl(sb->fs_version);
+	sb->main_fat = ntohs(sb->main_fat);
+	sb->main_fat_size = ntohs(sb->main_fat_size);
+	sb->backup_fat = ntohs(sb->backup_fat);
+	sb->backup_fat_size = ntohs(sb->backup_fat_size);
+	sb->directory_start = ntohs(sb->directory_start);
+	sb->directory_size = ntohs(sb->directory_size);
+	sb->num_user_blocks = ntohs(sb->num_user_blocks);
+	sb->first_user_block = ntohs(sb->first_user_block);
+}
+
+// Characters allowed in a filename besides letters and digits.
+static inline int is_filename_char(char c){
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+		c == '^' || c == '_' || c == '-' || c == '=' || c == '|';
+}
+
+/*
+ * Converts "name.ext" to the 11 byte 8.3 directory form: up to 8 name
+ * characters then up to 3 extension characters, both padded with '\0'.
+ * Returns 0, or -1 if the name is empty, too long, ends in a dot or has invalid characters.
+ */
+static inline int make_filename(char *filename, const char *name){
+	const char *dot = strchr(name, '.');
+	size_t base = dot ? (size_t) (dot - name) : strlen(name);
+	size_t ext = dot ? strlen(dot + 1) : 0;
+
+	if(base == 0 || base > 8 || ext > 3 || (dot && (ext == 0 || strchr(dot + 1, '.')))){
+		return -1;
+	}
+	memset(filename, '\0', 11);
+	for(size_t i = 0; i < base; i++){
+		if(!is_filename_char(name[i])){
+			return -1;
+		}
+		filename[i] = name[i];
+	}
+	for(size_t i = 0; i < ext; i++){
+		if(!is_filename_char(dot[1 + i])){
+			return -1;
+		}
+		filename[8 + i] = dot[1 + i];
+	}
+	return 0;
+}
+
+// Formats an 8.3 directory filename as "name.ext" (out holds at least 13 bytes).
+static inline void format_filename(const char *filename, char *out){
+	int length = 0;
+	for(int i = 0; i < 8 && filename[i] != '\0'; i++){
+		out[length++] = filename[i];
+	}
+	if(filename[8] != '\0'){
+		out[length++] = '.';
+		for(int i = 8; i < 11 && filename[i] != '\0'; i++){
+			out[length++] = filename[i];
+		}
+	}
+	out[length] = '\0';
+}
+
+// Converts a superblock to its on-disk form.
+static inline void encode_superblock(uint8_t *out, const memefs_superblock_t *sb){
+	memefs_superblock_t disk = *sb;
+	disk.fs_version = htonl(sb->fs_version);
+	disk.main_fat = htons(sb->main_fat);
+	disk.main_fat_size = htons(sb->main_fat_size);
+	disk.backup_fat = htons(sb->backup_fat);
+	disk.backup_fat_size = htons(sb->backup_fat_size);
+	disk.directory_start = htons(sb->directory_start);
+	disk.directory_size = htons(sb->directory_size);
+	disk.num_user_blocks = htons(sb->num_user_blocks);
+	disk.first_user_block = htons(sb->first_user_block);
+	memcpy(out, &disk, sizeof(disk));
+}
+
+// Converts a directory entry to its on-disk form.
+static inline void encode_dirent(uint8_t *out, const memefs_directory_t *entry){
+	memefs_directory_t disk = *entry;
+	disk.type = htons(entry->type);
+	disk.start_block = htons(entry->start_block);
+	disk.unused = 0;
+	disk.size = htonl(entry->size);
+	disk.ownerUID = htons(entry->ownerUID);
+	disk.groupGID = htons(entry->groupGID);
+	memcpy(out, &disk, sizeof(disk));
+}
+
+// Converts an on-disk directory entry to host byte order.
+static inline void decode_dirent(memefs_directory_t *entry, const uint8_t *in){
+	memcpy(entry, in, sizeof(*entry));
+	entry->type = ntohs(entry->type);
+	entry->start_block = ntohs(entry->start_block);
+	entry->unused = 0;
+	entry->size = ntohl(entry->size);
+	entry->ownerUID = ntohs(entry->ownerUID);
+	entry->groupGID = ntohs(entry->groupGID);
+}
+
+/*
+ * Bulk codec. Converting big-endian data is a fixed byte swap, the same in
+ * both directions, so each kernel serves decode and encode and may work in place.
+ */
+
+#if MEMEFS_SIMD
+// Byte swaps the leading multiple of 16 values, returns how many. Needs AVX2, checked at run time.
+__attribute__((target("avx2")))
+static inline size_t memefs_swap16_avx2(uint8_t *dst, const uint8_t *src, size_t count){
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16){
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + (i * 2)));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) (dst + (i * 2)), v);
+	}
+	return i;
+}
+#endif
+
+// Byte swaps count 16 bit values, 16 (AVX2) or 8 (SSE2) at a time.
+static inline void memefs_swap16(void *out, const void *in, size_t count){
+	const uint8_t *src = in;
+	uint8_t *dst = out;
+	size_t i = 0;
+
+#if MEMEFS_SIMD
+	if(__builtin_cpu_supports("avx2")){
+		i = memefs_swap16_avx2(dst, src, count);
+	}
+	for(; i + 8 <= count; i += 8){
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + (i * 2)));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (dst + (i * 2)), v);
+	}
+#endif
+	for(size_t offset = i * 2; offset < count * 2; offset += 2){
+		uint16_t value;
+		memcpy(&value, src + offset, 2);
+		value = ntohs(value);
+		memcpy(dst + offset, &value, 2);
+	}
+}
+
+#if MEMEFS_SIMD
+/*
+ * Swaps directory entries with one shuffle per 16 bytes: type and start_block
+ * in the first half, size, ownerUID and groupGID in the second. The unused
+ * byte (index 15) is cleared. Needs SSSE3, checked at run time.
+ */
+__attribute__((target("ssse3")))
+static inline void memefs_swap_dirents_ssse3(uint8_t *out, const uint8_t *in, size_t count){
+	const __m128i low = _mm_setr_epi8(1, 0, 3, 2, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, (char) 0x80);
+	const __m128i high = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 11, 10, 9, 8, 13, 12, 15, 14);
+
+	for(size_t i = 0; i < count; i++){
+		__m128i first = _mm_loadu_si128((const __m128i *) (in + (i * 32)));
+		__m128i second = _mm_loadu_si128((const __m128i *) (in + (i * 32) + 16));
+		_mm_storeu_si128((__m128i *) (out + (i * 32)), _mm_shuffle_epi8(first, low));
+		_mm_storeu_si128((__m128i *) (out + (i * 32) + 16), _mm_shuffle_epi8(second, high));
+	}
+}
+#endif
+
+static inline void memefs_swap_dirents(void *out, const void *in, size_t count){
+#if MEMEFS_SIMD
+	if(__builtin_cpu_supports("ssse3")){
+		memefs_swap_dirents_ssse3(out, in, count);
+		return;
+	}
+#endif
+	for(size_t i = 0; i < count; i++){
+		memefs_directory_t entry;
+		decode_dirent(&entry, (const uint8_t *) in + (i * sizeof(entry)));
+		memcpy((uint8_t *) out + (i * sizeof(entry)), &entry, sizeof(entry));
+	}
+}
+
+// Decodes a whole FAT block to host byte order.
+static inline void decode_fat(uint16_t *fat, const uint8_t *block){
+	memefs_swap16(fat, block, NUM_BLOCKS);
+}
+
+// Encodes a whole FAT to its on-disk block.
+static inline void encode_fat(uint8_t *block, const uint16_t *fat){
+	memefs_swap16(block, fat, NUM_BLOCKS);
+}
+
+// Decodes count consecutive on-disk directory entries.
+static inline void decode_directory(memefs_directory_t *entries, const uint8_t *in, size_t count){
+	memefs_swap_dirents(entries, in, count);
+}
+
+// Encodes count directory entries into consecutive on-disk entries.
+static inline void encode_directory(uint8_t *out, const memefs_directory_t *entries, size_t count){
+	memefs_swap_dirents(out, entries, count);
+}
+
+#endif
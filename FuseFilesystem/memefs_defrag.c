@@ -0,0 +1,216 @@
+/*
+    memefs_defrag.c
+
+    Offline compactor for MEMEfs images. Rewrites the image so every file is
+    one contiguous run of user blocks, in directory order, starting at the
+    first user block. The main and backup FAT are rebuilt to match and all
+    free space ends up as a single run at the end of the user area.
+
+    Usage: memefs-defrag [-n] [-o output] image
+        -n  only report what would move
+        -o  write the compacted image to output instead of replacing image
+
+    The image must be cleanly unmounted, mount it once to recover it first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "memefs.h"
+
+static uint8_t image[NUM_BLOCKS * BLOCK_SIZE];
+static uint8_t compacted[NUM_BLOCKS * BLOCK_SIZE];
+static mode_t image_mode;          // permissions of the image, given to the compacted one
+
+static uint8_t *block_at(uint8_t *base, int block){
+	return base + (block * BLOCK_SIZE);
+}
+
+static int read_image(const char *path){
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st)){
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	image_mode = st.st_mode & 07777;
+	if(pread(fd, image, sizeof(image), 0) != sizeof(image)){
+		fprintf(stderr, "%s: not a complete MEMEfs image\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// Writes the image next to its destination and renames it over, so a crash never leaves half an image.
+static int write_image(const char *path){
+	char tmpfn[4096];
+	int fd;
+
+	if(snprintf(tmpfn, sizeof(tmpfn), "%s.defragXXXXXX", path) >= (int) sizeof(tmpfn)){
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+	if((fd = mkstemp(tmpfn)) < 0){
+		perror("mkstemp");
+		return -1;
+	}
+	if(write(fd, compacted, sizeof(compacted)) != sizeof(compacted) || fsync(fd)){
+		perror("write");
+		close(fd);
+		unlink(tmpfn);
+		return -1;
+	}
+	//mkstemp creates the file 0600, the compacted image keeps the original's mode
+	if(fchmod(fd, image_mode)){
+		perror("fchmod");
+		close(fd);
+		unlink(tmpfn);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmpfn, path)){
+		perror("rename");
+		unlink(tmpfn);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copies every chain into consecutive blocks of the compacted image.
+ * Returns the number of blocks that changed position, or -1 if a chain is broken.
+ */
+static int compact(const uint16_t *fat, int *files){
+	uint16_t new_FAT[NUM_BLOCKS];
+	uint8_t visited[NUM_BLOCKS];
+	memefs_directory_t entry;
+	uint8_t *directory = block_at(compacted, DIRECTORY_START_BLOCK);
+	int next = FIRST_USER_BLOCK;
+	int moved = 0;
+
+	memcpy(compacted, image, sizeof(image));
+	memset(block_at(compacted, FIRST_USER_BLOCK), 0, NUM_USER_BLOCKS * BLOCK_SIZE);
+	memcpy(new_FAT, fat, sizeof(new_FAT));
+	memset(visited, 0, sizeof(visited));
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		new_FAT[block] = FAT_FREE;
+	}
+
+	*files = 0;
+	for(int slot = 0; slot < DIRECTORY_ENTRIES; slot++){
+		decode_dirent(&entry, directory + (slot * sizeof(memefs_directory_t)));
+		if(entry.type == 0){
+			continue;
+		}
+
+		int block = entry.start_block;
+		if(!is_user_block(block) || fat[block] == FAT_FREE || visited[block]){
+			fprintf(stderr, "Slot %d has a bad start block %d\n", slot, block);
+			return -1;
+		}
+		entry.start_block = next;
+		while(1){
+			visited[block] = 1;
+			memcpy(block_at(compacted, next), block_at(image, block), BLOCK_SIZE);
+			if(block != next){
+				moved++;
+			}
+			new_FAT[next] = FAT_END;
+			if(fat[block] == FAT_END){
+				break;
+			}
+			int link = fat_next(fat[block]);
+			if(!is_user_block(link) || fat[link] == FAT_FREE || visited[link]){
+				fprintf(stderr, "Slot %d has a broken chain at block %d\n", slot, block);
+				return -1;
+			}
+			//Holes of sparse files stay holes
+			new_FAT[next] = fat_link(fat_gap(fat[block]), next + 1);
+			block = link;
+			next++;
+		}
+		next++;
+		encode_dirent(directory + (slot * sizeof(memefs_directory_t)), &entry);
+		(*files)++;
+	}
+
+	encode_fat(block_at(compacted, MAIN_FAT_BLOCK), new_FAT);
+	encode_fat(block_at(compacted, BACKUP_FAT_BLOCK), new_FAT);
+	return moved;
+}
+
+static int usage(const char *program){
+	printf("Usage: %s [-n] [-o output] image\n", program ? program : "memefs-defrag");
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	uint16_t fat[NUM_BLOCKS];
+	memefs_superblock_t sb;
+	const char *output = NULL;
+	int dry_run = 0;
+	int option;
+	int files;
+
+	while((option = getopt(argc, argv, "no:")) != -1){
+		switch(option){
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1){
+		return usage(argc > 0 ? argv[0] : NULL);
+	}
+
+	if(read_image(argv[optind])){
+		return 1;
+	}
+
+	decode_superblock(&sb, block_at(image, MAIN_SUPERBLOCK_BLOCK));
+	if(memcmp(sb.signature, MEMEFS_SIGNATURE, 16) != 0){
+		fprintf(stderr, "%s: bad signature\n", argv[optind]);
+		return 1;
+	}
+	if(sb.cleanly_unmounted != MEMEFS_CLEAN){
+		fprintf(stderr, "%s: not cleanly unmounted, mount it once to recover it first\n", argv[optind]);
+		return 1;
+	}
+
+	decode_fat(fat, block_at(image, MAIN_FAT_BLOCK));
+	int moved = compact(fat, &files);
+	if(moved < 0){
+		fprintf(stderr, "%s: inconsistent image, not compacted\n", argv[optind]);
+		return 1;
+	}
+	//Blocks moved and free blocks were zeroed, the checksum table is taken afresh
+	if(sb.features & MEMEFS_CHECKSUMS){
+		build_checksums(compacted);
+	}
+
+	printf("%d files, %d blocks %s\n", files, moved, dry_run ? "would move" : "moved");
+	if(dry_run || (moved == 0 && output == NULL && memcmp(image, compacted, sizeof(image)) == 0)){
+		return 0;
+	}
+	return write_image(output ? output : argv[optind]) ? 1 : 0;
+}
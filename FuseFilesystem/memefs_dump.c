@@ -0,0 +1,225 @@
+/*
+    memefs_dump.c
+
+    Streams a MEMEfs image to stdout in the dump format described in
+    memefs.h: the superblocks, the main FAT, the directory and only the user
+    blocks that are allocated, files first in directory and chain order.
+    Free blocks, the backup FAT and the intent log are left out,
+    memefs-restore rebuilds them.
+
+    Usage: memefs-dump [-z] image > dump
+        -z  deflate the stream (needs zlib at build time)
+
+    The image must be cleanly unmounted, mount it once to recover it first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "memefs.h"
+
+static uint8_t image[NUM_BLOCKS * BLOCK_SIZE];
+static uint32_t checksum = FNV1A_SEED;
+static int compress_output = 0;
+#ifdef HAVE_ZLIB
+static z_stream deflater;
+static uint8_t deflated[64 * 1024];
+#endif
+
+static uint8_t *block_at(int block){
+	return image + (block * BLOCK_SIZE);
+}
+
+static int read_image(const char *path){
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		perror(path);
+		return -1;
+	}
+	if(pread(fd, image, sizeof(image), 0) != sizeof(image)){
+		fprintf(stderr, "%s: not a complete MEMEfs image\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int write_all(const void *data, size_t length){
+	if(fwrite(data, 1, length, stdout) != length){
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Appends to the stream after the header, through deflate with -z.
+ * finish ends the deflate stream.
+ */
+static int put_stream(const void *data, size_t length, int finish){
+#ifdef HAVE_ZLIB
+	if(compress_output){
+		deflater.next_in = (Bytef *) data;
+		deflater.avail_in = length;
+		do {
+			deflater.next_out = deflated;
+			deflater.avail_out = sizeof(deflated);
+			if(deflate(&deflater, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR){
+				fprintf(stderr, "deflate failed\n");
+				return -1;
+			}
+			if(write_all(deflated, sizeof(deflated) - deflater.avail_out)){
+				return -1;
+			}
+		} while(deflater.avail_out == 0);
+		return 0;
+	}
+#endif
+	(void) finish;
+	return write_all(data, length);
+}
+
+// Appends to the stream and to the checksum.
+static int put_body(const void *data, size_t length){
+	checksum = fnv1a_hash(checksum, data, length);
+	return put_stream(data, length, 0);
+}
+
+/*
+ * Lists the allocated user blocks, each file's chain in directory order
+ * first, then allocated blocks no file reaches so the restored FAT is exact.
+ * Returns the number of blocks.
+ */
+static int allocated_blocks(const uint16_t *fat, uint8_t *order){
+	uint8_t listed[NUM_BLOCKS];
+	memefs_directory_t entry;
+	int count = 0;
+
+	memset(listed, 0, sizeof(listed));
+	for(int slot = 0; slot < DIRECTORY_ENTRIES; slot++){
+		decode_dirent(&entry, block_at(DIRECTORY_START_BLOCK) + (slot * sizeof(memefs_directory_t)));
+		if(entry.type == 0){
+			continue;
+		}
+		//Holes of sparse files are not allocated and are simply skipped
+		int block = entry.start_block;
+		while(is_user_block(block) && fat[block] != FAT_FREE && !listed[block]){
+			listed[block] = 1;
+			order[count++] = block;
+			block = fat_next(fat[block]);
+		}
+	}
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		if(fat[block] != FAT_FREE && !listed[block]){
+			order[count++] = block;
+		}
+	}
+	return count;
+}
+
+static int dump(const uint16_t *fat){
+	memefs_dump_header_t header;
+	uint8_t order[NUM_USER_BLOCKS];
+	int count = allocated_blocks(fat, order);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DUMP_MAGIC, 8);
+	header.version = htonl(DUMP_VERSION);
+	header.flags = htonl(compress_output ? DUMP_COMPRESSED : 0);
+	header.blocks = htons(count);
+	if(write_all(&header, sizeof(header))){
+		return -1;
+	}
+
+	if(put_body(block_at(MAIN_SUPERBLOCK_BLOCK), BLOCK_SIZE) ||
+	   put_body(block_at(BACKUP_SUPERBLOCK_BLOCK), BLOCK_SIZE) ||
+	   put_body(block_at(MAIN_FAT_BLOCK), BLOCK_SIZE) ||
+	   put_body(block_at(DIRECTORY_START_BLOCK), DIRECTORY_BLOCKS * BLOCK_SIZE)){
+		return -1;
+	}
+	for(int j = 0; j < count; j++){
+		uint16_t block = htons(order[j]);
+		if(put_body(&block, sizeof(block)) || put_body(block_at(order[j]), BLOCK_SIZE)){
+			return -1;
+		}
+	}
+	uint32_t sum = htonl(checksum);
+	if(put_stream(&sum, sizeof(sum), 1) || fflush(stdout)){
+		return -1;
+	}
+	fprintf(stderr, "%d of %d user blocks dumped\n", count, NUM_USER_BLOCKS);
+	return 0;
+}
+
+static int usage(const char *program){
+	fprintf(stderr, "Usage: %s [-z] image > dump\n", program ? program : "memefs-dump");
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	uint16_t fat[NUM_BLOCKS];
+	memefs_superblock_t sb;
+	int option;
+
+	while((option = getopt(argc, argv, "z")) != -1){
+		switch(option){
+		case 'z':
+			compress_output = 1;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1){
+		return usage(argc > 0 ? argv[0] : NULL);
+	}
+#ifndef HAVE_ZLIB
+	if(compress_output){
+		fprintf(stderr, "%s: built without zlib, -z is not available\n", argv[0]);
+		return 1;
+	}
+#endif
+	if(isatty(STDOUT_FILENO)){
+		fprintf(stderr, "%s: not writing a dump to a terminal\n", argv[0]);
+		return 1;
+	}
+
+	if(read_image(argv[optind])){
+		return 1;
+	}
+	decode_superblock(&sb, block_at(MAIN_SUPERBLOCK_BLOCK));
+	if(memcmp(sb.signature, MEMEFS_SIGNATURE, 16) != 0){
+		fprintf(stderr, "%s: bad signature\n", argv[optind]);
+		return 1;
+	}
+	if(sb.cleanly_unmounted != MEMEFS_CLEAN){
+		fprintf(stderr, "%s: not cleanly unmounted, mount it once to recover it first\n", argv[optind]);
+		return 1;
+	}
+
+#ifdef HAVE_ZLIB
+	if(compress_output && deflateInit(&deflater, Z_DEFAULT_COMPRESSION) != Z_OK){
+		fprintf(stderr, "deflateInit failed\n");
+		return 1;
+	}
+#endif
+	decode_fat(fat, block_at(MAIN_FAT_BLOCK));
+	int result = dump(fat);
+#ifdef HAVE_ZLIB
+	if(compress_output){
+		deflateEnd(&deflater);
+	}
+#endif
+	return result ? 1 : 0;
+}
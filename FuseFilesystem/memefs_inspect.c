@@ -0,0 +1,504 @@
+/*
+    memefs_inspect.c
+
+    Offline checker for MEMEfs images. Parses both superblocks, both FATs and
+    the directory, verifies every file chain and reports free space, extents
+    per file, fragmentation and backup FAT divergence as text or JSON.
+
+    Usage: memefs-inspect [-j] [-q] [-s] [-t threads] image...
+        -j  one JSON object per image (one per line)
+        -q  summary only, no per file listing
+        -s  scrub: check every block against the image's checksum table
+        -t  scrub with this many threads (default: one per CPU)
+
+    Exit status is 0 when every image is consistent, 1 when problems were
+    found and 2 when an image could not be read.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "memefs.h"
+
+typedef struct file_report {
+	int slot;
+	char name[13];
+	uint32_t size;
+	int blocks;
+	uint32_t covered;          // blocks plus holes
+	int extents;
+	const char *error;
+} file_report_t;
+
+typedef struct image_report {
+	memefs_superblock_t main_sb;
+	memefs_superblock_t backup_sb;
+	uint16_t main_FAT[NUM_BLOCKS];
+	uint16_t backup_FAT[NUM_BLOCKS];
+	memefs_directory_t directory[DIRECTORY_ENTRIES];
+
+	int signature_ok;
+	int backup_signature_ok;
+	int superblocks_differ;
+	int fat_divergence;
+
+	file_report_t files[DIRECTORY_ENTRIES];
+	int num_files;
+	int used_blocks;
+	int free_blocks;
+	int free_extents;
+	int largest_free_extent;
+	int orphan_blocks;
+	int fragmented_files;
+	int total_extents;
+	int errors;
+} image_report_t;
+
+// Outcome of scrubbing one image (-s)
+#define SCRUB_DONE 0
+#define SCRUB_NO_TABLE 1          // the image has no checksums
+#define SCRUB_STALE 2             // not cleanly unmounted, the table is not current
+#define SCRUB_UNREADABLE 3
+typedef struct scrub_report {
+	int state;
+	int verified;
+	int bad_blocks;
+	uint8_t bad[NUM_BLOCKS];
+} scrub_report_t;
+
+static int json_output = 0;
+static int quiet = 0;
+static int scrub = 0;
+
+// Images of the command line, scrubbed by a pool of threads before the reports are printed
+static char **scrub_paths;
+static scrub_report_t *scrubs;
+static int scrub_count;
+static int scrub_next;
+
+// Reads the metadata blocks of an image into the report.
+static int load_image(const char *path, image_report_t *report){
+	uint8_t block[BLOCK_SIZE];
+	uint8_t directory[DIRECTORY_BLOCKS * BLOCK_SIZE];
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0){
+		perror(path);
+		return -1;
+	}
+
+	memset(report, 0, sizeof(*report));
+	if(pread(fd, block, BLOCK_SIZE, MAIN_SUPERBLOCK_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		goto short_read;
+	}
+	decode_superblock(&report->main_sb, block);
+	if(pread(fd, block, BLOCK_SIZE, BACKUP_SUPERBLOCK_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		goto short_read;
+	}
+	decode_superblock(&report->backup_sb, block);
+	if(pread(fd, block, BLOCK_SIZE, MAIN_FAT_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		goto short_read;
+	}
+	decode_fat(report->main_FAT, block);
+	if(pread(fd, block, BLOCK_SIZE, BACKUP_FAT_BLOCK * BLOCK_SIZE) != BLOCK_SIZE){
+		goto short_read;
+	}
+	decode_fat(report->backup_FAT, block);
+	if(pread(fd, directory, sizeof(directory), DIRECTORY_START_BLOCK * BLOCK_SIZE) != sizeof(directory)){
+		goto short_read;
+	}
+	decode_directory(report->directory, directory, DIRECTORY_ENTRIES);
+
+	close(fd);
+	return 0;
+
+short_read:
+	fprintf(stderr, "%s: not a complete MEMEfs image\n", path);
+	close(fd);
+	return -1;
+}
+
+// Compares the superblock fields that both copies must agree on.
+static int superblocks_differ(const memefs_superblock_t *a, const memefs_superblock_t *b){
+	return memcmp(a->signature, b->signature, 16) != 0 ||
+		memcmp(a->fs_ctime, b->fs_ctime, 8) != 0 ||
+		a->main_fat != b->main_fat || a->backup_fat != b->backup_fat ||
+		a->directory_start != b->directory_start || a->directory_size != b->directory_size ||
+		a->num_user_blocks != b->num_user_blocks ||
+		memcmp(a->volume_label, b->volume_label, 16) != 0;
+}
+
+// Walks every chain once and collects space and fragmentation figures.
+static void check_image(image_report_t *report){
+	uint8_t visited[NUM_BLOCKS];
+
+	memset(visited, 0, sizeof(visited));
+	report->signature_ok = memcmp(report->main_sb.signature, MEMEFS_SIGNATURE, 16) == 0;
+	report->backup_signature_ok = memcmp(report->backup_sb.signature, MEMEFS_SIGNATURE, 16) == 0;
+	report->superblocks_differ = superblocks_differ(&report->main_sb, &report->backup_sb);
+	if(!report->signature_ok){
+		report->errors++;
+	}
+
+	for(int block = 0; block < NUM_BLOCKS; block++){
+		if(report->main_FAT[block] != report->backup_FAT[block]){
+			report->fat_divergence++;
+		}
+	}
+
+	for(int slot = 0; slot < DIRECTORY_ENTRIES; slot++){
+		const memefs_directory_t *entry = &report->directory[slot];
+		if(entry->type == 0){
+			continue;
+		}
+
+		file_report_t *file = &report->files[report->num_files++];
+		file->slot = slot;
+		format_filename(entry->filename, file->name);
+		file->size = entry->size;
+
+		int block = entry->start_block;
+		if(!is_user_block(block) || report->main_FAT[block] == FAT_FREE){
+			file->error = "bad start block";
+		} else if(visited[block]){
+			file->error = "start block shared with another file";
+		} else {
+			int previous = -1;
+			uint32_t covered = 0;
+			while(1){
+				visited[block] = 1;
+				file->blocks++;
+				if(block != previous + 1){
+					file->extents++;
+				}
+				previous = block;
+
+				//Holes of sparse files count towards the size the chain covers
+				uint16_t value = report->main_FAT[block];
+				covered += 1 + fat_gap(value);
+				if(value == FAT_END){
+					break;
+				}
+				int next = fat_next(value);
+				if(!is_user_block(next) || report->main_FAT[next] == FAT_FREE){
+					file->error = "chain links to an invalid block";
+					break;
+				}
+				if(visited[next]){
+					file->error = "chain is cross-linked or loops";
+					break;
+				}
+				block = next;
+			}
+			file->covered = covered;
+		}
+
+		if(file->error == NULL && file->size > file->covered * BLOCK_SIZE){
+			file->error = "size is larger than its chain";
+		}
+		if(file->error != NULL){
+			report->errors++;
+		}
+		if(file->extents > 1){
+			report->fragmented_files++;
+		}
+		report->total_extents += file->extents;
+	}
+
+	int run = 0;
+	for(int block = FIRST_USER_BLOCK; block < FIRST_USER_BLOCK + NUM_USER_BLOCKS; block++){
+		if(report->main_FAT[block] == FAT_FREE){
+			report->free_blocks++;
+			if(run++ == 0){
+				report->free_extents++;
+			}
+			if(run > report->largest_free_extent){
+				report->largest_free_extent = run;
+			}
+			continue;
+		}
+		run = 0;
+		report->used_blocks++;
+		if(!visited[block]){
+			report->orphan_blocks++;
+		}
+	}
+	if(report->orphan_blocks > 0){
+		report->errors++;
+	}
+}
+
+// Reads a whole image and checks every block the table covers.
+static void scrub_image(const char *path, scrub_report_t *scrub_report){
+	uint8_t *image = malloc(NUM_BLOCKS * BLOCK_SIZE);
+	memefs_superblock_t sb;
+	int fd = open(path, O_RDONLY);
+
+	memset(scrub_report, 0, sizeof(*scrub_report));
+	if(image == NULL || fd < 0 || pread(fd, image, NUM_BLOCKS * BLOCK_SIZE, 0) != NUM_BLOCKS * BLOCK_SIZE){
+		scrub_report->state = SCRUB_UNREADABLE;
+		if(fd >= 0){
+			close(fd);
+		}
+		free(image);
+		return;
+	}
+	close(fd);
+
+	decode_superblock(&sb, image + (MAIN_SUPERBLOCK_BLOCK * BLOCK_SIZE));
+	if(!(sb.features & MEMEFS_CHECKSUMS)){
+		scrub_report->state = SCRUB_NO_TABLE;
+	} else if(sb.cleanly_unmounted != MEMEFS_CLEAN){
+		scrub_report->state = SCRUB_STALE;
+	}
+	for(int block = 0; scrub_report->state == SCRUB_DONE && block < NUM_BLOCKS; block++){
+		if(!is_checksummed_block(block)){
+			continue;
+		}
+		scrub_report->verified++;
+		if(memefs_crc32c(image + (block * BLOCK_SIZE), BLOCK_SIZE) != image_checksum(image, block)){
+			scrub_report->bad[block] = 1;
+			scrub_report->bad_blocks++;
+		}
+	}
+	free(image);
+}
+
+// Scrub worker: takes the next image until every one is done.
+static void *scrub_main(void *arg){
+	(void) arg;
+	int i;
+
+	while((i = __atomic_fetch_add(&scrub_next, 1, __ATOMIC_RELAXED)) < scrub_count){
+		scrub_image(scrub_paths[i], &scrubs[i]);
+	}
+	return NULL;
+}
+
+// Scrubs every image with up to threads workers, an image is the unit of work.
+static int scrub_images(char **paths, int count, int threads){
+	pthread_t workers[64];
+
+	scrub_paths = paths;
+	scrub_count = count;
+	scrub_next = 0;
+	if((scrubs = calloc(count, sizeof(*scrubs))) == NULL){
+		perror("calloc");
+		return -1;
+	}
+	if(threads <= 0){
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(threads > count){
+		threads = count;
+	}
+	if(threads > 64){
+		threads = 64;
+	}
+
+	//Threads that fail to start leave their share to the others, the caller's included
+	int started = 0;
+	while(started < threads - 1 && pthread_create(&workers[started], NULL, scrub_main, NULL) == 0){
+		started++;
+	}
+	scrub_main(NULL);
+	for(int j = 0; j < started; j++){
+		pthread_join(workers[j], NULL);
+	}
+	return 0;
+}
+
+// Share of free space not in the largest free run (0 = one contiguous run).
+static double free_space_fragmentation(const image_report_t *report){
+	if(report->free_blocks == 0){
+		return 0.0;
+	}
+	return 1.0 - ((double) report->largest_free_extent / report->free_blocks);
+}
+
+static int needs_compaction(const image_report_t *report){
+	return report->fragmented_files > 0 || report->free_extents > 1;
+}
+
+static void print_json_string(const char *text, size_t length){
+	putchar('"');
+	for(size_t i = 0; i < length && text[i] != '\0'; i++){
+		unsigned char c = text[i];
+		if(c == '"' || c == '\\'){
+			printf("\\%c", c);
+		} else if(c < 0x20 || c >= 0x7F){
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+static void print_json(const char *path, const image_report_t *report, const scrub_report_t *scrub_report){
+	const memefs_superblock_t *sb = &report->main_sb;
+
+	printf("{\"image\":");
+	print_json_string(path, strlen(path));
+	printf(",\"volume\":");
+	print_json_string(sb->volume_label, 16);
+	printf(",\"version\":%u,\"created\":\"%02X%02X-%02X-%02X %02X:%02X:%02X\"",
+		sb->fs_version, sb->fs_ctime[0], sb->fs_ctime[1], sb->fs_ctime[2],
+		sb->fs_ctime[3], sb->fs_ctime[4], sb->fs_ctime[5], sb->fs_ctime[6]);
+	printf(",\"clean\":%s,\"signature_ok\":%s,\"backup_signature_ok\":%s,\"superblocks_differ\":%s",
+		sb->cleanly_unmounted == MEMEFS_CLEAN ? "true" : "false",
+		report->signature_ok ? "true" : "false",
+		report->backup_signature_ok ? "true" : "false",
+		report->superblocks_differ ? "true" : "false");
+	printf(",\"fat_divergence\":%d", report->fat_divergence);
+	printf(",\"used_blocks\":%d,\"free_blocks\":%d,\"free_bytes\":%d,\"free_extents\":%d,\"largest_free_extent\":%d",
+		report->used_blocks, report->free_blocks, report->free_blocks * BLOCK_SIZE,
+		report->free_extents, report->largest_free_extent);
+	printf(",\"free_space_fragmentation\":%.3f,\"orphan_blocks\":%d", free_space_fragmentation(report), report->orphan_blocks);
+	printf(",\"files\":%d,\"fragmented_files\":%d,\"total_extents\":%d,\"needs_compaction\":%s,\"errors\":%d",
+		report->num_files, report->fragmented_files, report->total_extents,
+		needs_compaction(report) ? "true" : "false", report->errors);
+	printf(",\"checksums\":%s", sb->features & MEMEFS_CHECKSUMS ? "true" : "false");
+	if(scrub_report != NULL){
+		static const char *states[] = { "done", "no_table", "stale", "unreadable" };
+		printf(",\"scrub\":\"%s\",\"verified_blocks\":%d,\"bad_blocks\":[",
+			states[scrub_report->state], scrub_report->verified);
+		for(int block = 0, listed = 0; block < NUM_BLOCKS; block++){
+			if(scrub_report->bad[block]){
+				printf("%s%d", listed++ ? "," : "", block);
+			}
+		}
+		putchar(']');
+	}
+
+	if(!quiet){
+		printf(",\"file_list\":[");
+		for(int i = 0; i < report->num_files; i++){
+			const file_report_t *file = &report->files[i];
+			printf("%s{\"slot\":%d,\"name\":", i ? "," : "", file->slot);
+			print_json_string(file->name, sizeof(file->name));
+			printf(",\"size\":%u,\"blocks\":%d,\"extents\":%d,\"error\":", file->size, file->blocks, file->extents);
+			if(file->error){
+				print_json_string(file->error, strlen(file->error));
+			} else {
+				printf("null");
+			}
+			putchar('}');
+		}
+		putchar(']');
+	}
+	printf("}\n");
+}
+
+static void print_text(const char *path, const image_report_t *report, const scrub_report_t *scrub_report){
+	const memefs_superblock_t *sb = &report->main_sb;
+
+	printf("Image: %s\n", path);
+	printf("  Volume: %.16s  version %u  created %02X%02X-%02X-%02X %02X:%02X:%02X  %s\n",
+		sb->volume_label, sb->fs_version, sb->fs_ctime[0], sb->fs_ctime[1], sb->fs_ctime[2],
+		sb->fs_ctime[3], sb->fs_ctime[4], sb->fs_ctime[5], sb->fs_ctime[6],
+		sb->cleanly_unmounted == MEMEFS_CLEAN ? "clean" : "NOT cleanly unmounted");
+	printf("  Signature: %s  backup: %s  superblocks %s\n",
+		report->signature_ok ? "ok" : "BAD", report->backup_signature_ok ? "ok" : "BAD",
+		report->superblocks_differ ? "differ" : "agree");
+	printf("  Backup FAT: %d entries differ from the main FAT\n", report->fat_divergence);
+	printf("  Space: %d used, %d free blocks (%d bytes), %d free extents, largest %d, fragmentation %.1f%%\n",
+		report->used_blocks, report->free_blocks, report->free_blocks * BLOCK_SIZE,
+		report->free_extents, report->largest_free_extent, free_space_fragmentation(report) * 100.0);
+	printf("  Files: %d, %d fragmented, %d extents, %d orphan blocks\n",
+		report->num_files, report->fragmented_files, report->total_extents, report->orphan_blocks);
+	if(scrub_report == NULL){
+		printf("  Checksums: %s\n", sb->features & MEMEFS_CHECKSUMS ? "on" : "off");
+	} else if(scrub_report->state == SCRUB_NO_TABLE){
+		printf("  Checksums: off, nothing to scrub\n");
+	} else if(scrub_report->state == SCRUB_STALE){
+		printf("  Checksums: not current until the image is mounted and unmounted again\n");
+	} else if(scrub_report->state == SCRUB_UNREADABLE){
+		printf("  Checksums: image could not be read\n");
+	} else {
+		printf("  Checksums: %d blocks verified, %d bad", scrub_report->verified, scrub_report->bad_blocks);
+		for(int block = 0; block < NUM_BLOCKS; block++){
+			if(scrub_report->bad[block]){
+				printf(" %d", block);
+			}
+		}
+		putchar('\n');
+	}
+
+	if(!quiet){
+		for(int i = 0; i < report->num_files; i++){
+			const file_report_t *file = &report->files[i];
+			printf("    [%3d] %-12s %8u bytes %4d blocks %3d extents%s%s\n",
+				file->slot, file->name, file->size, file->blocks, file->extents,
+				file->error ? "  ERROR: " : "", file->error ? file->error : "");
+		}
+	}
+	printf("  %s, %d errors%s\n\n", report->errors ? "INCONSISTENT" : "consistent",
+		report->errors, needs_compaction(report) ? ", compaction recommended" : "");
+}
+
+static int usage(const char *program){
+	printf("Usage: %s [-j] [-q] [-s] [-t threads] image...\n", program ? program : "memefs-inspect");
+	return 2;
+}
+
+int main(int argc, char *argv[]){
+	static image_report_t report;
+	int status = 0;
+	int threads = 0;
+	int option;
+
+	while((option = getopt(argc, argv, "jqst:")) != -1){
+		switch(option){
+		case 'j':
+			json_output = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 's':
+			scrub = 1;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if(optind >= argc){
+		return usage(argc > 0 ? argv[0] : NULL);
+	}
+	if(scrub && scrub_images(argv + optind, argc - optind, threads)){
+		return 2;
+	}
+
+	for(int i = optind; i < argc; i++){
+		const scrub_report_t *scrub_report = scrub ? &scrubs[i - optind] : NULL;
+		if(load_image(argv[i], &report)){
+			status = 2;
+			continue;
+		}
+		check_image(&report);
+		if(scrub_report != NULL && scrub_report->bad_blocks > 0){
+			report.errors++;
+		}
+		if(json_output){
+			print_json(argv[i], &report, scrub_report);
+		} else {
+			print_text(argv[i], &report, scrub_report);
+		}
+		if(report.errors && status == 0){
+			status = 1;
+		}
+	}
+	free(scrubs);
+	return status;
+}
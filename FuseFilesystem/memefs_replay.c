@@ -0,0 +1,290 @@
+/*
+    memefs_replay.c
+
+    Replays an operation trace recorded with memefs -o record=FILE through
+    mounted MEMEfs volumes, turning each callback back into the system call
+    that causes it, and reports per-operation latency next to the recorded
+    one. Operations are issued one at a time in the order they started, as
+    fast as they go or, with -t, at the recorded pace. Files opened before
+    the recording started are opened on first use.
+
+    Usage: memefs-replay [-t] trace mountpoint [mountpoint...]
+        -t  keep the recorded pace instead of replaying at full speed
+
+    The n-th mountpoint replays the operations of the n-th volume= of the
+    recording, volumes without one go to the first. Use memefs -o replay=FILE
+    to replay in-process without fuse and the kernel.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "memefs.h"
+#include "trace.h"
+
+typedef struct replay_handle {
+	uint64_t id;               // handle in the trace
+	int fd;
+} replay_handle_t;
+
+static replay_handle_t *handles;
+static int open_handles;
+static int handle_capacity;
+static char *buffer;               // data for reads and writes, as large as the largest
+static char **mountpoints;
+static int num_mountpoints;
+
+static int find_handle(uint64_t id){
+	for(int j = open_handles - 1; j >= 0; j--){
+		if(handles[j].id == id){
+			return handles[j].fd;
+		}
+	}
+	return -1;
+}
+
+static int add_handle(uint64_t id, int fd){
+	if(open_handles == handle_capacity){
+		int capacity = handle_capacity ? handle_capacity * 2 : 64;
+		replay_handle_t *grown = realloc(handles, capacity * sizeof(*grown));
+		if(grown == NULL){
+			close(fd);
+			return -1;
+		}
+		handles = grown;
+		handle_capacity = capacity;
+	}
+	handles[open_handles].id = id;
+	handles[open_handles++].fd = fd;
+	return fd;
+}
+
+static void drop_handle(uint64_t id){
+	for(int j = 0; j < open_handles; j++){
+		if(handles[j].id == id){
+			handles[j] = handles[--open_handles];
+			return;
+		}
+	}
+}
+
+static int join_path(char *full, const trace_entry_t *entry){
+	const char *mountpoint = mountpoints[entry->volume < num_mountpoints ? entry->volume : 0];
+	return snprintf(full, PATH_MAX, "%s%s", mountpoint, entry->path) >= PATH_MAX ? -1 : 0;
+}
+
+// Files opened before recording started are opened on first use, untimed
+static int replay_fd(const trace_entry_t *entry, const char *full){
+	int fd = find_handle(entry->handle);
+
+	if(fd >= 0 || entry->op == TRACE_OP_RELEASE){
+		return fd;
+	}
+	fd = open(full, O_RDWR);
+	if(fd < 0){
+		fd = open(full, O_RDONLY);
+	}
+	return fd < 0 ? -1 : add_handle(entry->handle, fd);
+}
+
+static int list_directory(const char *full){
+	DIR *dir = opendir(full);
+
+	if(dir == NULL){
+		return -errno;
+	}
+	errno = 0;
+	while(readdir(dir) != NULL){
+	}
+	int error = errno;
+	closedir(dir);
+	return -error;
+}
+
+static int64_t result_of(int64_t value){
+	return value < 0 ? -errno : value;
+}
+
+/**
+ * Issues the system call behind one trace entry and returns how long it
+ * took, UINT64_MAX when it could not be replayed
+ */
+static uint64_t replay_entry(const trace_entry_t *entry, int64_t *result){
+	char full[PATH_MAX];
+	struct timespec begin;
+	struct stat st;
+	struct statvfs stv;
+	int fd = -1;
+
+	if(join_path(full, entry)){
+		return UINT64_MAX;
+	}
+	switch(entry->op){
+	case TRACE_OP_READ:
+	case TRACE_OP_WRITE:
+	case TRACE_OP_FLUSH:
+	case TRACE_OP_RELEASE:
+	case TRACE_OP_LSEEK:
+	case TRACE_OP_FSYNC:
+		fd = replay_fd(entry, full);
+		if(fd < 0){
+			return UINT64_MAX;
+		}
+		break;
+	case TRACE_OP_GETATTR:
+	case TRACE_OP_TRUNCATE:
+	case TRACE_OP_UTIMENS:
+		//The handle is optional for these
+		if(entry->handle != 0){
+			fd = find_handle(entry->handle);
+		}
+		break;
+	case TRACE_OP_READDIR:
+		//The kernel continues a listing by itself, only its start is replayed
+		if(entry->offset != 0){
+			return UINT64_MAX;
+		}
+		break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	switch(entry->op){
+	case TRACE_OP_GETATTR:
+		*result = result_of(fd >= 0 ? fstat(fd, &st) : lstat(full, &st));
+		break;
+	case TRACE_OP_READDIR:
+		*result = list_directory(full);
+		break;
+	case TRACE_OP_CREATE:
+		fd = open(full, O_CREAT | O_RDWR, entry->extra & 07777);
+		*result = result_of(fd);
+		break;
+	case TRACE_OP_UNLINK:
+		*result = result_of(unlink(full));
+		break;
+	case TRACE_OP_OPEN:
+		fd = open(full, entry->extra & ~(O_CREAT | O_EXCL));
+		*result = result_of(fd);
+		break;
+	case TRACE_OP_READ:
+		*result = result_of(pread(fd, buffer, entry->size, entry->offset));
+		break;
+	case TRACE_OP_WRITE:
+		*result = result_of(pwrite(fd, buffer, entry->size, entry->offset));
+		break;
+	case TRACE_OP_FLUSH:
+		//Closing a duplicate flushes without releasing the file
+		*result = result_of(close(dup(fd)));
+		break;
+	case TRACE_OP_RELEASE:
+		*result = result_of(close(fd));
+		break;
+	case TRACE_OP_TRUNCATE:
+		*result = result_of(fd >= 0 ? ftruncate(fd, entry->offset) : truncate(full, entry->offset));
+		break;
+	case TRACE_OP_LSEEK:
+		*result = result_of(lseek(fd, entry->offset, entry->extra));
+		break;
+	case TRACE_OP_UTIMENS:
+		*result = result_of(fd >= 0 ? futimens(fd, NULL) : utimensat(AT_FDCWD, full, NULL, 0));
+		break;
+	case TRACE_OP_FSYNC:
+		*result = result_of(entry->extra ? fdatasync(fd) : fsync(fd));
+		break;
+	case TRACE_OP_STATFS:
+		*result = result_of(statvfs(mountpoints[entry->volume < num_mountpoints ? entry->volume : 0], &stv));
+		break;
+	default:
+		return UINT64_MAX;
+	}
+	uint64_t latency = trace_clock(&begin);
+
+	//Successful opens report 0 like the callback, the descriptor is kept
+	if(entry->op == TRACE_OP_CREATE || entry->op == TRACE_OP_OPEN){
+		if(fd >= 0){
+			*result = 0;
+			add_handle(entry->handle, fd);
+		}
+	} else if(entry->op == TRACE_OP_RELEASE){
+		drop_handle(entry->handle);
+	}
+	return latency;
+}
+
+static int usage(const char *program){
+	fprintf(stderr, "Usage: %s [-t] trace mountpoint [mountpoint...]\n", program ? program : "memefs-replay");
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	struct timespec origin;
+	uint32_t largest = 1;
+	int timed = 0;
+	int option;
+	size_t count;
+
+	while((option = getopt(argc, argv, "t")) != -1){
+		switch(option){
+		case 't':
+			timed = 1;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if(argc - optind < 2){
+		return usage(argc > 0 ? argv[0] : NULL);
+	}
+	mountpoints = argv + optind + 1;
+	num_mountpoints = argc - optind - 1;
+
+	trace_entry_t *entries = load_trace(argv[optind], &count);
+	if(entries == NULL){
+		return 1;
+	}
+	for(size_t i = 0; i < count; i++){
+		if(entries[i].size > largest){
+			largest = entries[i].size;
+		}
+	}
+	uint64_t *latency = malloc((count + 1) * sizeof(*latency));
+	int64_t *result = calloc(count + 1, sizeof(*result));
+	buffer = malloc(largest);
+	if(latency == NULL || result == NULL || buffer == NULL){
+		perror("malloc");
+		return 1;
+	}
+	memset(buffer, 'M', largest);
+
+	clock_gettime(CLOCK_MONOTONIC, &origin);
+	for(size_t i = 0; i < count; i++){
+		if(timed){
+			trace_wait(&origin, entries[i].start - entries[0].start);
+		}
+		latency[i] = replay_entry(&entries[i], &result[i]);
+	}
+	uint64_t elapsed = trace_clock(&origin);
+
+	//Files the trace left open are closed so their writes reach the image
+	for(int j = 0; j < open_handles; j++){
+		close(handles[j].fd);
+	}
+	report_replay(entries, latency, result, count, elapsed);
+
+	free(handles);
+	free(buffer);
+	free(latency);
+	free(result);
+	free_trace(entries, count);
+	return 0;
+}
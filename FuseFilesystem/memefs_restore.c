@@ -0,0 +1,221 @@
+/*
+    memefs_restore.c
+
+    Rebuilds a MEMEfs image from a memefs-dump stream read from stdin in one
+    sequential pass. Blocks that are not in the stream (free blocks and the
+    intent log) are zero, the backup FAT is a copy of the main FAT and the
+    checksum table, if the image has one, is rebuilt. The image is written
+    next to its destination and renamed over it.
+
+    Usage: memefs-restore image < dump
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "memefs.h"
+
+static uint8_t image[NUM_BLOCKS * BLOCK_SIZE];
+static uint32_t checksum = FNV1A_SEED;
+static int compressed_input = 0;
+#ifdef HAVE_ZLIB
+static z_stream inflater;
+static uint8_t inflated[64 * 1024];
+#endif
+
+static uint8_t *block_at(int block){
+	return image + (block * BLOCK_SIZE);
+}
+
+/**
+ * Reads exactly length bytes of the stream after the header, through
+ * inflate for a compressed dump. Returns -1 if the stream ends early.
+ */
+static int get_stream(void *data, size_t length){
+#ifdef HAVE_ZLIB
+	if(compressed_input){
+		inflater.next_out = data;
+		inflater.avail_out = length;
+		while(inflater.avail_out > 0){
+			if(inflater.avail_in == 0){
+				size_t got = fread(inflated, 1, sizeof(inflated), stdin);
+				if(got == 0){
+					return -1;
+				}
+				inflater.next_in = inflated;
+				inflater.avail_in = got;
+			}
+			int result = inflate(&inflater, Z_NO_FLUSH);
+			if(result == Z_STREAM_END && inflater.avail_out > 0){
+				return -1;
+			}
+			if(result != Z_OK && result != Z_STREAM_END){
+				return -1;
+			}
+		}
+		return 0;
+	}
+#endif
+	return fread(data, 1, length, stdin) == length ? 0 : -1;
+}
+
+// Reads part of the stream covered by the checksum.
+static int get_body(void *data, size_t length){
+	if(get_stream(data, length)){
+		return -1;
+	}
+	checksum = fnv1a_hash(checksum, data, length);
+	return 0;
+}
+
+// Writes the image next to its destination and renames it over, so a failed restore never leaves half an image.
+static int write_image(const char *path){
+	char tmpfn[4096];
+	int fd;
+
+	if(snprintf(tmpfn, sizeof(tmpfn), "%s.restoreXXXXXX", path) >= (int) sizeof(tmpfn)){
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+	if((fd = mkstemp(tmpfn)) < 0){
+		perror("mkstemp");
+		return -1;
+	}
+	if(write(fd, image, sizeof(image)) != sizeof(image) || fsync(fd)){
+		perror("write");
+		close(fd);
+		unlink(tmpfn);
+		return -1;
+	}
+	//mkstemp creates the file 0600, keep the replaced image's mode or use the default for a new one
+	struct stat st;
+	mode_t mode;
+	if(stat(path, &st) == 0){
+		mode = st.st_mode & 07777;
+	} else {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	}
+	if(fchmod(fd, mode)){
+		perror("fchmod");
+		close(fd);
+		unlink(tmpfn);
+		return -1;
+	}
+	close(fd);
+	if(rename(tmpfn, path)){
+		perror("rename");
+		unlink(tmpfn);
+		return -1;
+	}
+	return 0;
+}
+
+static int restore(int blocks){
+	uint16_t fat[NUM_BLOCKS];
+	uint8_t restored[NUM_BLOCKS];
+	memefs_superblock_t sb;
+
+	if(get_body(block_at(MAIN_SUPERBLOCK_BLOCK), BLOCK_SIZE) ||
+	   get_body(block_at(BACKUP_SUPERBLOCK_BLOCK), BLOCK_SIZE) ||
+	   get_body(block_at(MAIN_FAT_BLOCK), BLOCK_SIZE) ||
+	   get_body(block_at(DIRECTORY_START_BLOCK), DIRECTORY_BLOCKS * BLOCK_SIZE)){
+		fprintf(stderr, "dump ends inside the metadata\n");
+		return -1;
+	}
+	decode_superblock(&sb, block_at(MAIN_SUPERBLOCK_BLOCK));
+	if(memcmp(sb.signature, MEMEFS_SIGNATURE, 16) != 0){
+		fprintf(stderr, "dump holds a bad signature\n");
+		return -1;
+	}
+	memcpy(block_at(BACKUP_FAT_BLOCK), block_at(MAIN_FAT_BLOCK), BLOCK_SIZE);
+	decode_fat(fat, block_at(MAIN_FAT_BLOCK));
+
+	//Only blocks the FAT has allocated are accepted, each one once
+	memset(restored, 0, sizeof(restored));
+	for(int j = 0; j < blocks; j++){
+		uint16_t block;
+		if(get_body(&block, sizeof(block))){
+			fprintf(stderr, "dump ends after %d of %d blocks\n", j, blocks);
+			return -1;
+		}
+		block = ntohs(block);
+		if(!is_user_block(block) || fat[block] == FAT_FREE || restored[block]){
+			fprintf(stderr, "dump holds an unexpected block %d\n", block);
+			return -1;
+		}
+		restored[block] = 1;
+		if(get_body(block_at(block), BLOCK_SIZE)){
+			fprintf(stderr, "dump ends inside block %d\n", block);
+			return -1;
+		}
+	}
+
+	uint32_t expected = checksum;
+	uint32_t sum;
+	if(get_stream(&sum, sizeof(sum)) || ntohl(sum) != expected){
+		fprintf(stderr, "dump checksum does not match\n");
+		return -1;
+	}
+	//The table is not in the dump, it is taken from the restored blocks
+	if(sb.features & MEMEFS_CHECKSUMS){
+		build_checksums(image);
+	}
+	fprintf(stderr, "%d user blocks restored\n", blocks);
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	memefs_dump_header_t header;
+
+	if(argc != 2){
+		fprintf(stderr, "Usage: %s image < dump\n", argc > 0 ? argv[0] : "memefs-restore");
+		return 1;
+	}
+	if(fread(&header, 1, sizeof(header), stdin) != sizeof(header) || memcmp(header.magic, DUMP_MAGIC, 8) != 0){
+		fprintf(stderr, "%s: input is not a MEMEfs dump\n", argv[0]);
+		return 1;
+	}
+	if(ntohl(header.version) != DUMP_VERSION){
+		fprintf(stderr, "%s: dump version %u is not supported\n", argv[0], ntohl(header.version));
+		return 1;
+	}
+	compressed_input = (ntohl(header.flags) & DUMP_COMPRESSED) != 0;
+	int blocks = ntohs(header.blocks);
+	if(blocks > NUM_USER_BLOCKS){
+		fprintf(stderr, "%s: dump claims %d user blocks\n", argv[0], blocks);
+		return 1;
+	}
+
+#ifdef HAVE_ZLIB
+	if(compressed_input && inflateInit(&inflater) != Z_OK){
+		fprintf(stderr, "inflateInit failed\n");
+		return 1;
+	}
+#else
+	if(compressed_input){
+		fprintf(stderr, "%s: dump is compressed and this build has no zlib\n", argv[0]);
+		return 1;
+	}
+#endif
+	int result = restore(blocks);
+#ifdef HAVE_ZLIB
+	if(compressed_input){
+		inflateEnd(&inflater);
+	}
+#endif
+	if(result || write_image(argv[1])){
+		return 1;
+	}
+	return 0;
+}
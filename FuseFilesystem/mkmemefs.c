@@ -40,35 +40,30 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 
-    // Structure representing the superblock metadata for the filesystem.
-    typedef struct memefs_superblock
-{
-    char signature[16];        // Filesystem signature
-    uint8_t cleanly_unmounted; // Flag for unmounted state
-    uint8_t reseerved1[3];     // Reserved bytes
-    uint32_t fs_version;       // Filesystem version
-    uint8_t fs_ctime[8];       // Creation timestamp in BCD format
-    uint16_t main_fat;         // Starting block for main FAT
-    uint16_t main_fat_size;    // Size of the main FAT
-    uint16_t backup_fat;       // Starting block for backup FAT
-    uint16_t backup_fat_size;  // Size of the backup FAT
-    uint16_t directory_start;  // Starting block for directory
-    uint16_t directory_size;   // Directory size in blocks
-    uint16_t num_user_blocks;  // Number of user data blocks
-    uint16_t first_user_block; // First user data block
-    char volume_label[16];     // Volume label
-    uint8_t unused[448];       // Unused space for alignment
-} __attribute__((packed)) memefs_superblock_t;
+#include "memefs.h"
 
 // Buffer for holding data blocks to be written to the filesystem image.
 static uint8_t block_buf[512];
 
-// Writes a 512-byte block to a file descriptor.
-static inline int write_block(int fd)
+// The whole image, assembled in memory and written out with a single write.
+static uint8_t image_buf[256 * 512];
+
+// Set by -c: the image keeps a CRC32C of every block (see memefs.h).
+static int checksums = 0;
+
+// Set by -s: a source file without a valid 8.3 name stops the build instead of being skipped.
+static int strict_names = 0;
+
+// Copies the block buffer into a block of the image.
+static inline void put_block(int blk)
 {
-    return write(fd, block_buf, 512) != 512;
+    memcpy(image_buf + (blk * 512), block_buf, 512);
 }
 
 // Clears the block buffer by setting all bytes to zero.
@@ -84,27 +79,35 @@ static inline uint8_t pbcd(uint8_t num)
     return b <= 9 ? ((b << 4) | a) : 0xFF;
 }
 
-// Fills the superblock structure with metadata, including the volume label.
-static void fill_superblock(const char *volname)
+// Encodes a time as the 8-byte BCD timestamp used by the superblock and directory.
+static void fill_bcd_time(uint8_t bcd[8], time_t when)
 {
-    memefs_superblock_t *sb = (memefs_superblock_t *)block_buf;
-    time_t now = time(NULL);
     struct tm ts;
 
-    gmtime_r(&now, &ts); // Gets the current time in UTC format.
+    gmtime_r(&when, &ts); // Gets the time in UTC format.
+
+    bcd[0] = pbcd((ts.tm_year + 1900) / 100);
+    bcd[1] = pbcd(ts.tm_year % 100);
+    bcd[2] = pbcd(ts.tm_mon + 1);
+    bcd[3] = pbcd(ts.tm_mday);
+    bcd[4] = pbcd(ts.tm_hour);
+    bcd[5] = pbcd(ts.tm_min);
+    bcd[6] = pbcd(ts.tm_sec);
+    bcd[7] = 0;
+}
+
+// Fills the superblock structure with metadata, including the volume label.
+static void fill_superblock(const char *volname, uint32_t version)
+{
+    memefs_superblock_t *sb = (memefs_superblock_t *)block_buf;
 
     clear_block_buf();                             // Initializes block buffer to zero.
-    memcpy(sb->signature, "?MEMEFS+CMSC421\0", 16); // Sets filesystem signature.
-    sb->fs_version = htonl(1);                     // Sets filesystem version in network byte order.
+    memcpy(sb->signature, MEMEFS_SIGNATURE, 16); // Sets filesystem signature.
+    sb->fs_version = htonl(version);               // Sets filesystem version in network byte order.
+    sb->features = checksums ? MEMEFS_CHECKSUMS : 0;
 
     // Fills BCD-encoded creation time.
-    sb->fs_ctime[0] = pbcd((ts.tm_year + 1900) / 100);
-    sb->fs_ctime[1] = pbcd(ts.tm_year % 100);
-    sb->fs_ctime[2] = pbcd(ts.tm_mon + 1);
-    sb->fs_ctime[3] = pbcd(ts.tm_mday);
-    sb->fs_ctime[4] = pbcd(ts.tm_hour);
-    sb->fs_ctime[5] = pbcd(ts.tm_min);
-    sb->fs_ctime[6] = pbcd(ts.tm_sec);
+    fill_bcd_time(sb->fs_ctime, time(NULL));
 
     // Sets FAT and directory metadata fields.
     sb->main_fat = htons(254);
@@ -140,70 +143,145 @@ static void fill_blank_fat(void)
     }
 }
 
-// Writes the initialized FAT block to the image file.
-static int write_fat(int fd)
+// Places the superblock at the start and end of the image.
+static void place_superblock(const char *volname, uint32_t version)
 {
-    fill_blank_fat(); // Prepares the FAT entries.
+    fill_superblock(volname, version); // Populates superblock metadata.
+    put_block(255);                    // Superblock at the end of the file system.
+    put_block(0);                      // Backup superblock at the beginning.
+}
 
-    // Writes the main FAT.
-    if (lseek(fd, 254 * 512, SEEK_SET) < 0)
+// Places the main and backup FAT in the image.
+static void place_fat(const uint16_t *fat)
+{
+    encode_fat(block_buf, fat);
+    put_block(254);
+    put_block(239);
+}
+
+// Adds one host file to the image as a single contiguous run of user blocks.
+static int add_file(const char *dirname, const char *name, uint16_t *fat, int *next_block, int *slot)
+{
+    char path[4096];
+    struct stat st;
+    memefs_directory_t entry;
+    int i, fd, blocks;
+    ssize_t got;
+    size_t done = 0;
+    uint8_t *directory = image_buf + (DIRECTORY_START_BLOCK * 512);
+
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dirname, name);
+    if (stat(path, &st))
     {
-        perror("fseek");
+        perror(path);
         return -1;
     }
-    if (write_block(fd))
+    if (!S_ISREG(st.st_mode))
     {
-        perror("write_block");
-        return -1;
+        fprintf(stderr, "Skipping %s: not a regular file\n", path);
+        return 0;
     }
 
-    // Writes the backup FAT.
-    if (lseek(fd, 239 * 512, SEEK_SET) < 0)
+    // Validates the name and rejects duplicates.
+    memset(&entry, 0, sizeof(entry));
+    if (make_filename(entry.filename, name))
     {
-        perror("fseek");
-        return -1;
+        if (strict_names)
+        {
+            fprintf(stderr, "%s: not a valid 8.3 filename\n", path);
+            return -1;
+        }
+        fprintf(stderr, "Skipping %s: not a valid 8.3 filename\n", path);
+        return 0;
     }
-    if (write_block(fd))
+    for (i = 0; i < *slot; ++i)
     {
-        perror("write_block");
-        return -1;
+        if (!memcmp(directory + (i * sizeof(entry)) + offsetof(memefs_directory_t, filename), entry.filename, 11))
+        {
+            fprintf(stderr, "%s: duplicate 8.3 filename\n", path);
+            return -1;
+        }
     }
 
-    return 0;
-}
-
-// Writes the superblock to the start and end locations in the image file.
-static int write_superblock(int fd, const char *volname)
-{
-    fill_superblock(volname); // Populates superblock metadata.
-
-    // Writes the superblock at the end of the file system.
-    if (lseek(fd, 255 * 512, SEEK_SET) < 0)
+    // Every file owns at least one block, like a freshly created one.
+    blocks = st.st_size ? (st.st_size + 511) / 512 : 1;
+    if (*slot >= DIRECTORY_ENTRIES)
     {
-        perror("fseek");
+        fprintf(stderr, "%s: directory is full\n", path);
         return -1;
     }
-    if (write_block(fd))
+    if (*next_block + blocks > FIRST_USER_BLOCK + NUM_USER_BLOCKS)
     {
-        perror("write_block");
+        fprintf(stderr, "%s: does not fit in the image\n", path);
         return -1;
     }
 
-    // Writes the superblock at the beginning of the filesystem.
-    if (lseek(fd, 0 * 512, SEEK_SET) < 0)
+    // Reads the contents straight into the user blocks.
+    if ((fd = open(path, O_RDONLY)) < 0)
     {
-        perror("fseek");
+        perror(path);
         return -1;
     }
-    if (write_block(fd))
+    while (done < (size_t)st.st_size)
     {
-        perror("write_block");
-        return -1;
+        got = read(fd, image_buf + (*next_block * 512) + done, st.st_size - done);
+        if (got <= 0)
+        {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        done += got;
     }
+    close(fd);
 
+    // Links the run and fills the directory entry.
+    for (i = 0; i < blocks - 1; ++i)
+        fat[*next_block + i] = *next_block + i + 1;
+    fat[*next_block + blocks - 1] = FAT_END;
+
+    entry.type = S_IFREG | (st.st_mode & 0777);
+    entry.start_block = *next_block;
+    fill_bcd_time(entry.timestamp, st.st_mtime);
+    entry.size = st.st_size;
+    entry.ownerUID = st.st_uid;
+    entry.groupGID = st.st_gid;
+    encode_dirent(directory + (*slot * sizeof(entry)), &entry);
+
+    *next_block += blocks;
+    ++*slot;
     return 0;
 }
 
+// Adds every regular file of a host directory, in name order, to the image.
+static int populate_image(const char *dirname, uint16_t *fat)
+{
+    struct dirent **names;
+    int i, count, rv = 0;
+    int next_block = FIRST_USER_BLOCK, slot = 0;
+
+    if ((count = scandir(dirname, &names, NULL, alphasort)) < 0)
+    {
+        perror(dirname);
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (!rv && add_file(dirname, names[i]->d_name, fat, &next_block, &slot))
+            rv = -1;
+        free(names[i]);
+    }
+    free(names);
+
+    if (!rv)
+        printf("Added %d files using %d blocks\n", slot, next_block - FIRST_USER_BLOCK);
+    return rv ? rv : slot;
+}
+
 // Copies a file from source to destination in 512-byte chunks.
 static int copy_file(const char *src, const char *dst)
 {
@@ -239,22 +317,59 @@ static int copy_file(const char *src, const char *dst)
     return 0;
 }
 
+// Prints the usage message.
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-c] [-d source_dir [-s]] image_filename [vol_name]\n"
+           "  -c  keep a checksum of every block\n"
+           "  -d  add the regular files of source_dir, skipping names that are not 8.3\n"
+           "  -s  with -d, stop at the first name that is not 8.3 instead\n", prog ? prog : "mkmemefs");
+}
+
 // Main function for creating a filesystem image file.
 int main(int argc, char *argv[])
 {
-    int fd;
+    int fd, opt, files = 0;
     char tmpfn[64];
+    const char *source_dir = NULL;
+    uint16_t fat[256];
 
-    // Ensures the correct number of arguments are provided.
-    if (argc < 2 || argc > 3)
+    while ((opt = getopt(argc, argv, "cd:s")) != -1)
     {
-        if (argc > 0)
-            printf("Usage: %s image_filename [vol_name]\n", argv[0]);
+        if (opt == 'c')
+            checksums = 1;
+        else if (opt == 'd')
+            source_dir = optarg;
+        else if (opt == 's')
+            strict_names = 1;
         else
-            printf("Usage: mkmemefs image_filename [vol_name]\n");
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Ensures the correct number of arguments are provided.
+    if (argc - optind < 1 || argc - optind > 2)
+    {
+        usage(argc > 0 ? argv[0] : NULL);
         return 1;
     }
 
+    // Builds the blank FAT, then lays out the source files if any.
+    fill_blank_fat();
+    decode_fat(fat, block_buf);
+    if (source_dir && (files = populate_image(source_dir, fat)) < 0)
+        return 1;
+
+    // A populated image already has a directory, so it starts past version 1.
+    place_superblock(argc - optind == 2 ? argv[optind + 1] : NULL, files ? 2 : 1);
+    place_fat(fat);
+
+    // The checksums cover the finished blocks, so they are taken last.
+    if (checksums)
+        build_checksums(image_buf);
+
     strcpy(tmpfn, "/tmp/mkmemefsXXXXXX");
 
     // Creates a temporary file.
@@ -264,40 +379,24 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Sets the size of the file to 256 blocks (512 bytes each).
-    if (ftruncate(fd, 256 * 512))
-    {
-        perror("ftruncate");
-        close(fd);
-        unlink(tmpfn);
-        return 1;
-    }
-
-    // Writes the superblock data to the image file.
-    if (write_superblock(fd, argc == 3 ? argv[2] : NULL))
+    // Writes all 256 blocks (512 bytes each) at once.
+    if (write(fd, image_buf, sizeof(image_buf)) != sizeof(image_buf))
     {
+        perror("write");
         close(fd);
         unlink(tmpfn);
         return 1;
     }
 
-    // Writes the FAT to the image file.
-    if (write_fat(fd))
-    {
-        close(fd);
-        unlink(tmpfn);
-        return -1;
-    }
-
     close(fd);
 
     // Renames the temporary file to the desired output filename.
-    if (rename(tmpfn, argv[1]))
+    if (rename(tmpfn, argv[optind]))
     {
         if (errno == EXDEV)
         {
             // If rename fails, attempts to copy the file instead.
-            if (!copy_file(tmpfn, argv[1]))
+            if (!copy_file(tmpfn, argv[optind]))
             {
                 unlink(tmpfn);
                 return 0;
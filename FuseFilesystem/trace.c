@@ -0,0 +1,184 @@
+/*
+    trace.c
+
+    Loading, pacing and reporting of the operation traces described in
+    memefs.h, shared by memefs -o replay=FILE and memefs-replay.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "memefs.h"
+#include "trace.h"
+
+const char *trace_op_name(int op){
+	static const char *names[TRACE_OPS] = {
+		"getattr", "readdir", "create", "unlink", "open", "read", "write",
+		"flush", "release", "truncate", "lseek", "utimens", "fsync", "statfs",
+	};
+	return op >= 0 && op < TRACE_OPS ? names[op] : "unknown";
+}
+
+
+static int compare_trace_start(const void *a, const void *b){
+	const trace_entry_t *x = a;
+	const trace_entry_t *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+void free_trace(trace_entry_t *entries, size_t count){
+	for(size_t i = 0; i < count; i++){
+		free(entries[i].path);
+	}
+	free(entries);
+}
+
+/**
+ * Reads a whole trace, sorted by the time each callback started so a replay
+ * issues them in that order. Returns NULL after printing why it failed.
+ */
+trace_entry_t *load_trace(const char *file, size_t *count){
+	memefs_trace_header_t header;
+	memefs_trace_record_t record;
+	size_t capacity = 4096;
+	trace_entry_t *entries = malloc(capacity * sizeof(*entries));
+	FILE *in = fopen(file, "rb");
+
+	*count = 0;
+	if(in == NULL || entries == NULL){
+		perror(file);
+		free(entries);
+		if(in != NULL){
+			fclose(in);
+		}
+		return NULL;
+	}
+	if(fread(&header, 1, sizeof(header), in) != sizeof(header) || memcmp(header.magic, TRACE_MAGIC, 8) != 0){
+		fprintf(stderr, "%s: not a MEMEfs trace\n", file);
+		fclose(in);
+		free(entries);
+		return NULL;
+	}
+	if(ntohl(header.version) != TRACE_VERSION){
+		fprintf(stderr, "%s: trace version %u is not supported\n", file, ntohl(header.version));
+		fclose(in);
+		free(entries);
+		return NULL;
+	}
+	size_t got;
+	while((got = fread(&record, 1, sizeof(record), in)) == sizeof(record)){
+		if(*count == capacity){
+			trace_entry_t *grown = realloc(entries, capacity * 2 * sizeof(*entries));
+			if(grown == NULL){
+				perror("load_trace");
+				break;
+			}
+			entries = grown;
+			capacity *= 2;
+		}
+		trace_entry_t *entry = &entries[*count];
+		decode_trace_record(entry, &record);
+		entry->path = calloc(1, record.path_length + 1);
+		if(entry->path == NULL || fread(entry->path, 1, record.path_length, in) != record.path_length){
+			free(entry->path);
+			got = 1;
+			break;
+		}
+		(*count)++;
+	}
+	//A recorder that was killed leaves a torn last record, the rest still replays
+	if(got != 0 || ferror(in)){
+		fprintf(stderr, "%s: trace is cut short after %zu records\n", file, *count);
+	}
+	fclose(in);
+	qsort(entries, *count, sizeof(*entries), compare_trace_start);
+	return entries;
+}
+
+// Nanoseconds from origin to now on CLOCK_MONOTONIC.
+uint64_t trace_clock(const struct timespec *origin){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) (now.tv_sec - origin->tv_sec) * 1000000000ull) + now.tv_nsec - origin->tv_nsec;
+}
+
+// Sleeps until offset ns after origin, for a replay at the recorded pace.
+void trace_wait(const struct timespec *origin, uint64_t offset){
+	struct timespec until = *origin;
+	until.tv_sec += offset / 1000000000ull;
+	until.tv_nsec += offset % 1000000000ull;
+	if(until.tv_nsec >= 1000000000){
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0){
+	}
+}
+
+static int compare_latency(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Prints per-callback latency of a replay next to the recorded one.
+ * latency and result hold what the replay measured for each entry, a
+ * latency of UINT64_MAX marks an entry that was skipped. "differ" counts
+ * results other than the recorded ones, the last line totals them.
+ */
+void report_replay(const trace_entry_t *entries, const uint64_t *latency, const int64_t *result, size_t count, uint64_t elapsed){
+	uint64_t *sorted = malloc((count ? count : 1) * sizeof(*sorted));
+	size_t replayed = 0;
+	size_t differ_total = 0;
+
+	if(sorted == NULL){
+		perror("report_replay");
+		return;
+	}
+	printf("%-9s %8s %8s %7s %10s %10s %10s %10s %10s\n",
+	       "op", "count", "skipped", "differ", "rec avg", "avg", "p50", "p99", "max");
+	for(int op = 0; op < TRACE_OPS; op++){
+		size_t n = 0;
+		size_t skipped = 0;
+		size_t differ = 0;
+		uint64_t recorded = 0;
+		uint64_t total = 0;
+		for(size_t i = 0; i < count; i++){
+			if(entries[i].op != op){
+				continue;
+			}
+			if(latency[i] == UINT64_MAX){
+				skipped++;
+				continue;
+			}
+			differ += result[i] != entries[i].result;
+			recorded += entries[i].latency;
+			total += latency[i];
+			sorted[n++] = latency[i];
+		}
+		if(n + skipped == 0){
+			continue;
+		}
+		replayed += n;
+		differ_total += differ;
+		printf("%-9s %8zu %8zu %7zu", trace_op_name(op), n, skipped, differ);
+		if(n == 0){
+			printf("\n");
+			continue;
+		}
+		qsort(sorted, n, sizeof(*sorted), compare_latency);
+		printf(" %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus\n", recorded / 1000.0 / n, total / 1000.0 / n,
+		       sorted[(n - 1) / 2] / 1000.0, sorted[((n - 1) * 99) / 100] / 1000.0, sorted[n - 1] / 1000.0);
+	}
+	printf("%zu of %zu operations replayed in %.3f s", replayed, count, elapsed / 1e9);
+	if(elapsed > 0){
+		printf(", %.0f ops/s", replayed / (elapsed / 1e9));
+	}
+	printf("\n%zu results differ from the recording\n", differ_total);
+	free(sorted);
+}
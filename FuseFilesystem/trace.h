@@ -0,0 +1,29 @@
+/*
+    trace.h
+
+    Trace helpers in trace.c, for memefs and memefs-replay. The trace
+    format itself is in memefs.h.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "memefs.h"
+
+const char *trace_op_name(int op);
+
+// Reads a whole trace sorted by start time, NULL after printing why not.
+trace_entry_t *load_trace(const char *file, size_t *count);
+void free_trace(trace_entry_t *entries, size_t count);
+
+uint64_t trace_clock(const struct timespec *origin);
+void trace_wait(const struct timespec *origin, uint64_t offset);
+
+// Prints a replay's per-callback latency next to the recorded one.
+void report_replay(const trace_entry_t *entries, const uint64_t *latency, const int64_t *result, size_t count, uint64_t elapsed);
+
+#endif